@@ -7,11 +7,13 @@
  */
 
 #include <algorithm>
+#include <random>
 #include <sstream>
 
 #include "command.h"
 #include "image.h"
 #include "math/SH.h"
+#include "math/rng.h"
 #include "dwi/gradient.h"
 #include "phase_encoding.h"
 #include "dwi/shells.h"
@@ -19,6 +21,10 @@
 
 #include "dwi/svr/qspacebasis.h"
 #include "dwi/svr/recon.h"
+#include "dwi/svr/bsr.h"
+#include "dwi/svr/precond.h"
+#include "dwi/svr/multigrid.h"
+#include "dwi/svr/solver.h"
 
 #define DEFAULT_LMAX 4
 #define DEFAULT_SSPW 1.0f
@@ -26,12 +32,20 @@
 #define DEFAULT_ZREG 0.001
 #define DEFAULT_TOL 1e-4
 #define DEFAULT_MAXITER 10
+#define DEFAULT_SUBSPACE 4
 
 
 using namespace MR;
 using namespace App;
 
 
+const char* const solvers[] = { "lscg", "cg", "lsqr", "lsmr", nullptr };
+const char* const preconditioners[] = { "none", "jacobi", "block", "multigrid", nullptr };
+const char* const reductions[] = { "lock", "slab", "pull", nullptr };
+const char* const projections[] = { "shot", "group", "volume", nullptr };
+const char* const interps[] = { "linear", "cubic", nullptr };
+
+
 void usage ()
 {
   AUTHOR = "Daan Christiaens (daan.christiaens@kcl.ac.uk)";
@@ -69,6 +83,11 @@ void usage ()
                    "Gaussian SSP, relative to the voxel size. (default = " + str(DEFAULT_SSPW)  + ")")
     + Argument ("w").type_text()
 
+  + Option ("interp", "the interpolation kernel of the recon operator: linear or cubic. Linear "
+                      "interpolation takes 8 instead of 64 recon voxels per sample, for cheaper "
+                      "but blurrier reconstructions. (default = cubic)")
+    + Argument ("kernel").type_choice(interps)
+
   + Option ("reg", "Isotropic Laplacian regularization. (default = " + str(DEFAULT_REG) + ")")
     + Argument ("l").type_float()
 
@@ -101,16 +120,91 @@ void usage ()
 
   + OptionGroup ("CG Optimization options")
 
+  + Option ("solver", "the iterative solver: lscg (least-squares conjugate gradient on the weighted and "
+                      "regularised system), cg (conjugate gradient on the normal equations, using the "
+                      "fused projection operator), or lsqr or lsmr (on the weighted and regularised system, "
+                      "with fused vector updates). (default = lscg)")
+    + Argument ("type").type_choice(solvers)
+
+  + Option ("precond", "the preconditioner: none, jacobi (inverse diagonal of the normal matrix, "
+                       "computed from the interpolation, slice profile and q-space weights), or block "
+                       "(block-Jacobi, inverting the coupling between all coefficients of each voxel), or "
+                       "multigrid (one V-cycle over 2x and 4x coarser recon grids; only with -solver cg). "
+                       "(default = none)")
+    + Argument ("type").type_choice(preconditioners)
+
+  + Option ("assemble", "assemble the normal matrix in block-sparse form before the CG iterations, "
+                        "if the size of its nonzero blocks is below the given memory limit (in GB), "
+                        "and use the matrix-free operator otherwise. Only used with -solver cg.")
+    + Argument ("mem").type_float(0.0)
+
+  + Option ("cache", "precompute the sparse projection operator, if its estimated size is below the "
+                     "given memory limit (in GB), instead of recomputing the interpolation weights "
+                     "in every iteration.")
+    + Argument ("mem").type_float(0.0)
+
+  + Option ("reduction", "the reduction strategy in the transpose projection: lock (concurrent slices "
+                         "write back under per-voxel locks) or slab (every thread owns a z-slab of the "
+                         "recon volume and collects all contributions to it, without locks) or pull (as slab, "
+                         "for small blocks of recon voxels that gather only from the source voxels "
+                         "in reach). With -solver cg, slab and pull reduction split the fused normal "
+                         "projection into a forward and a transpose projection, which store a "
+                         "prediction of all source voxels. "
+                         "(default = lock)")
+    + Argument ("type").type_choice(reductions)
+
+  + Option ("projection", "the projection of the recon: shot (shot by shot), group (resample the recon "
+                          "once for all shots with the same motion, if that is estimated to be faster; "
+                          "-reduction slab or pull still applies to the transpose projection) or volume "
+                          "(contract the recon planes in the footprint of each volume with the q-space "
+                          "projections of all its shots in one matrix product; falls back to shot if its "
+                          "scratch memory exceeds the size of the recon). "
+                          "(default = shot)")
+    + Argument ("type").type_choice(projections)
+
+  + Option ("bricks", "store the recon coefficients in bricks of the given size (e.g. 4,4,4 or 8,8,4 "
+                      "voxels) in the projections, so that the interpolation stencils of rotated slices "
+                      "gather from nearby memory. (default = voxel-major order)")
+    + Argument ("size").type_sequence_int()
+
   + Option ("tolerance", "the tolerance on the conjugate gradient solver. (default = " + str(DEFAULT_TOL) + ")")
     + Argument ("t").type_float(0.0, 1.0)
 
+  + Option ("xtol", "stop the lsqr or lsmr solver when the relative change of the solution (within the "
+                    "mask, if provided) drops below this tolerance. Only valid with -solver lsqr or lsmr. "
+                    "(default = 0; disabled)")
+    + Argument ("t").type_float(0.0, 1.0)
+
+  + Option ("mask", "reconstruction mask, used to evaluate the convergence of the lsqr or lsmr solver. "
+                    "Only valid with -solver lsqr or lsmr.")
+    + Argument ("image").type_image_in()
+
   + Option ("maxiter",
             "the maximum number of iterations of the conjugate gradient solver. (default = " + str(DEFAULT_MAXITER) + ")")
     + Argument ("n").type_integer(1)
 
   + Option ("init",
             "initial guess of the reconstruction parameters.")
-    + Argument ("img").type_image_in();
+    + Argument ("img").type_image_in()
+
+  + Option ("bootstrap",
+            "reconstruct the given no. bootstrap replicates, resampling the slices with Poisson(1) "
+            "weights. All replicates are solved at once with a multi-image cg solver, and stored "
+            "along the 6th axis of the output.")
+    + Argument ("k").type_integer(1)
+
+  + Option ("subspace_in",
+            "deflation subspace for the cg solver, as a 6-D MSSH image of approximate eigenvectors "
+            "(e.g., exported in a previous motion correction epoch).")
+    + Argument ("img").type_image_in()
+
+  + Option ("subspace_out",
+            "export the recycled deflation subspace of the cg solver, as a 6-D MSSH image.")
+    + Argument ("img").type_image_out()
+
+  + Option ("subspace_size",
+            "no. vectors in the exported deflation subspace. (default = " + str(DEFAULT_SUBSPACE) + ")")
+    + Argument ("k").type_integer(1);
 
 }
 
@@ -118,6 +212,68 @@ void usage ()
 typedef float value_type;
 
 
+template <class MatrixType, class Preconditioner>
+Eigen::VectorXf solve_cg (const MatrixType& M, const Eigen::VectorXf& b, const Eigen::VectorXf& x0,
+                          const value_type tol, const size_t maxiter)
+{
+  Eigen::ConjugateGradient<MatrixType, Eigen::Lower | Eigen::Upper, Preconditioner> cg;
+  cg.compute(M);
+  cg.setTolerance(tol);
+  cg.setMaxIterations(maxiter);
+  Eigen::VectorXf x = cg.solveWithGuess(b, x0);
+  CONSOLE("CG: #iterations: " + str(cg.iterations()));
+  CONSOLE("CG: estimated error: " + str(cg.error()));
+  return x;
+}
+
+
+template <class MatrixType, class Preconditioner>
+Eigen::VectorXf solve_cg (const MatrixType& M, const Eigen::VectorXf& b, const Eigen::VectorXf& x0,
+                          const value_type tol, const size_t maxiter, Eigen::MatrixXf* subspace, const size_t nsub)
+{
+  if (!subspace)
+    return solve_cg<MatrixType, Preconditioner>(M, b, x0, tol, maxiter);
+  DWI::SVR::DeflatedConjugateGradient<MatrixType, Preconditioner> cg (M, *subspace, 2*nsub);
+  cg.setTolerance(tol);
+  cg.setMaxIterations(maxiter);
+  Eigen::VectorXf x = cg.solveWithGuess(b, x0);
+  CONSOLE("CG: #iterations: " + str(cg.iterations()) + " (deflated, " + str(subspace->cols()) + " vectors)");
+  CONSOLE("CG: estimated error: " + str(cg.error()));
+  *subspace = cg.ritz(nsub);
+  return x;
+}
+
+
+template <class MatrixType>
+Eigen::VectorXf solve_cg (const MatrixType& M, const Eigen::VectorXf& b, const Eigen::VectorXf& x0,
+                          const value_type tol, const size_t maxiter, const int precond,
+                          Eigen::MatrixXf* subspace = nullptr, const size_t nsub = 0)
+{
+  if (precond == 1)
+    return solve_cg<MatrixType, DWI::SVR::JacobiPreconditioner>(M, b, x0, tol, maxiter, subspace, nsub);
+  if (precond == 2)
+    return solve_cg<MatrixType, DWI::SVR::BlockJacobiPreconditioner>(M, b, x0, tol, maxiter, subspace, nsub);
+  if (precond == 3)
+    return solve_cg<MatrixType, DWI::SVR::MultigridPreconditioner>(M, b, x0, tol, maxiter, subspace, nsub);
+  return solve_cg<MatrixType, Eigen::IdentityPreconditioner>(M, b, x0, tol, maxiter, subspace, nsub);
+}
+
+
+template <class Preconditioner>
+Eigen::VectorXf solve_lscg (const DWI::SVR::ReconMatrix& R, const Eigen::VectorXf& y, const Eigen::VectorXf& x0,
+                            const value_type tol, const size_t maxiter)
+{
+  Eigen::LeastSquaresConjugateGradient<DWI::SVR::ReconMatrix, Preconditioner> cg;
+  cg.compute(R);
+  cg.setTolerance(tol);
+  cg.setMaxIterations(maxiter);
+  Eigen::VectorXf x = cg.solveWithGuess(y, x0);
+  CONSOLE("CG: #iterations: " + str(cg.iterations()));
+  CONSOLE("CG: estimated error: " + str(cg.error()));
+  return x;
+}
+
+
 
 void run ()
 {
@@ -283,7 +439,25 @@ void run ()
 
 
   // Create mapping
-  DWI::SVR::ReconMapping map (rechdr, srchdr, qbasis, motionsub, ssp);
+  DWI::SVR::ReconMapping map (rechdr, srchdr, qbasis, motionsub, ssp,
+                              DWI::SVR::InterpKernel(get_option_value("interp", int(DWI::SVR::INTERP_CUBIC))));
+  opt = get_options("bricks");
+  if (opt.size()) {
+    auto bsize = parse_ints(opt[0][0]);
+    if (bsize.size() != 3 || *std::min_element(bsize.begin(), bsize.end()) < 1)
+      throw Exception("brick size should be 3 positive integers.");
+    map.set_bricks(bsize[0], bsize[1], bsize[2]);
+  }
+  opt = get_options("cache");
+  if (opt.size()) {
+    float memlimit = float(opt[0][0]) * (1 << 30);
+    if (map.memory() < memlimit)
+      map.precompute();
+    else
+      INFO("projection operator exceeds memory limit (" + str(map.memory() >> 20) + " MB); not cached.");
+  }
+  map.set_reduction(DWI::SVR::ReconMapping::Reduction(get_option_value("reduction", 0)));
+  map.set_projection(DWI::SVR::ReconMapping::Projection(get_option_value("projection", 0)));
 
   // Set up scattered data matrix
   INFO("initialise reconstruction matrix");
@@ -309,14 +483,14 @@ void run ()
   // Fit scattered data in basis...
   INFO("initialise conjugate gradient solver");
 
-  Eigen::LeastSquaresConjugateGradient<DWI::SVR::ReconMatrix, Eigen::IdentityPreconditioner> cg;
-  cg.compute(R);
-
-  cg.setTolerance(tol);
-  cg.setMaxIterations(maxiter);
+  // Conversion between recon coefficients and MSSH
+  Eigen::MatrixXf x2mssh (shells.count() * Math::SH::NforL(lmax), ncoefs); x2mssh.setZero();
+  for (int k = 0; k < shells.count(); k++)
+    x2mssh.middleRows(k*Math::SH::NforL(lmax), Math::SH::NforL(lmax)) = qbasis.getShellBasis(k).transpose();
+  auto mssh2x = x2mssh.fullPivHouseholderQr();
 
-  // Solve y = M x
-  Eigen::VectorXf x (R.cols());
+  // Set starting point
+  Eigen::VectorXf x0 (R.cols()); x0.setZero();
   opt = get_options("init");
   if (opt.size()) {
     // load initialisation
@@ -324,14 +498,8 @@ void run ()
     check_dimensions(rechdr, init, 0, 3);
     if ((init.size(3) != shells.count()) || (init.size(4) < Math::SH::NforL(lmax)))
       throw Exception("dimensions of init image don't match.");
-    // init vector
-    Eigen::VectorXf x0 (R.cols());
     // convert from mssh
-    Eigen::VectorXf c (shells.count() * Math::SH::NforL(lmax));
-    Eigen::MatrixXf x2mssh (c.size(), ncoefs); x2mssh.setZero();
-    for (int k = 0; k < shells.count(); k++)
-      x2mssh.middleRows(k*Math::SH::NforL(lmax), Math::SH::NforL(lmax)) = qbasis.getShellBasis(k).transpose();
-    auto mssh2x = x2mssh.fullPivHouseholderQr();
+    Eigen::VectorXf c (x2mssh.rows());
     size_t j = 0, k = 0;
     for (auto l = Loop("loading initialisation", {0, 1, 2})(init); l; l++, j+=ncoefs) {
       k = 0;
@@ -342,15 +510,139 @@ void run ()
       x0.segment(j, ncoefs) = mssh2x.solve(c);
     }
     INFO("solve from given starting point");
-    x = cg.solveWithGuess(y, x0);
   }
   else {
     INFO("solve from zero starting point");
-    x = cg.solve(y);
   }
 
-  CONSOLE("CG: #iterations: " + str(cg.iterations()));
-  CONSOLE("CG: estimated error: " + str(cg.error()));
+  // Solve y = M x
+  Eigen::VectorXf x (R.cols());
+  int solver = get_option_value("solver", 0);
+  int precond = get_option_value("precond", 0);
+  if (precond == 3 && solver != 1)
+    throw Exception ("multigrid preconditioner requires -solver cg.");
+  if (precond && solver > 1)
+    throw Exception ("preconditioning is not supported with -solver lsqr or lsmr.");
+  if ((get_options("xtol").size() || get_options("mask").size()) && solver < 2)
+    throw Exception ("-xtol and -mask require -solver lsqr or lsmr.");
+
+  // Bootstrap replicates
+  size_t nboot = get_option_value("bootstrap", 0);
+  Eigen::MatrixXf xboot;
+  if (nboot && (get_options("spred").size() || solver || precond))
+    throw Exception ("bootstrap reconstruction does not support -spred, -solver or -precond.");
+
+  // Deflation subspace
+  bool deflate = get_options("subspace_in").size() || get_options("subspace_out").size();
+  if (deflate && solver != 1)
+    throw Exception ("subspace recycling requires -solver cg.");
+  size_t nsub = get_option_value("subspace_size", DEFAULT_SUBSPACE);
+  Eigen::MatrixXf subspace (R.cols(), 0);
+  opt = get_options("subspace_in");
+  if (opt.size()) {
+    auto sub = Image<value_type>::open(opt[0][0]);
+    check_dimensions(rechdr, sub, 0, 3);
+    if ((sub.ndim() != 6) || (sub.size(3) != shells.count()) || (sub.size(4) < Math::SH::NforL(lmax)))
+      throw Exception("dimensions of deflation subspace don't match.");
+    subspace.resize(R.cols(), sub.size(5));
+    Eigen::VectorXf c (x2mssh.rows());
+    for (auto l0 = Loop("loading deflation subspace", 5)(sub); l0; l0++) {
+      size_t j = 0, k = 0;
+      for (auto l = Loop(0, 3)(sub); l; l++, j+=ncoefs) {
+        k = 0;
+        for (auto l2 = Loop(3)(sub); l2; l2++) {
+          for (sub.index(4) = 0; sub.index(4) < Math::SH::NforL(lmax); sub.index(4)++)
+            c[k++] = std::isfinite((float) sub.value()) ? sub.value() : 0.0f;
+        }
+        subspace.col(sub.index(5)).segment(j, ncoefs) = mssh2x.solve(c);
+      }
+    }
+    subspace.colwise().normalize();
+  }
+
+  // reuse the scratch buffers of the projections across all iterations
+  auto buffers = map.keep_buffers();
+
+  if (nboot) {
+    using RowMatrixXf = DWI::SVR::ReconMatrix::RowMatrixXf;
+    const size_t nxyz = voxel_count(rechdr, 0, 3), nxy = dwisub.size(0) * dwisub.size(1);
+    // resampling weights per slice and replicate
+    Math::RNG rng;
+    std::poisson_distribution<int> poisson (1.0);
+    RowMatrixXf Wboot (map.rows(), nboot);
+    RowMatrixXf Yboot (map.rows(), nboot);
+    size_t j = 0;
+    for (auto l = Loop(2, 4)(dwisub); l; l++) {
+      for (size_t r = 0; r < nboot; r++)
+        Wboot.block(j, r, nxy, 1).setConstant(poisson(rng));
+      float ws = Wsub(size_t(dwisub.index(2)), size_t(dwisub.index(3)));
+      for (auto l2 = Loop(0, 2)(dwisub); l2; l2++, j++) {
+        Wboot.row(j) *= Wvox[j];
+        Yboot.row(j) = ws * dwisub.value() * Wboot.row(j);
+      }
+    }
+    RowMatrixXf B (nxyz, nboot*ncoefs); B.setZero();
+    map.y2x_multi(B, Yboot);
+    RowMatrixXf X0 (nxyz, nboot*ncoefs);
+    for (size_t r = 0; r < nboot; r++)
+      X0.middleCols(r*ncoefs, ncoefs) = Eigen::Map<const RowMatrixXf> (x0.data(), nxyz, ncoefs);
+    DWI::SVR::BatchConjugateGradient cg (R, Wboot);
+    cg.setTolerance(tol);
+    cg.setMaxIterations(maxiter);
+    RowMatrixXf X = cg.solveWithGuess(B, X0);
+    CONSOLE("CG: #iterations: " + str(cg.iterations()) + " (" + str(nboot) + " replicates)");
+    CONSOLE("CG: estimated error: " + str(cg.error()));
+    xboot.resize(R.cols(), nboot);
+    for (size_t r = 0; r < nboot; r++)
+      Eigen::Map<RowMatrixXf> (xboot.col(r).data(), nxyz, ncoefs) = X.middleCols(r*ncoefs, ncoefs);
+    x = xboot.col(0);
+  }
+  else if (solver == 1) {
+    Eigen::VectorXf b = R.adjoint() * y;
+    float memlimit = get_option_value("assemble", 0.0f) * (1 << 30);
+    std::unique_ptr<DWI::SVR::ReconMatrixBSR> N;
+    if (memlimit > 0) {
+      N.reset (new DWI::SVR::ReconMatrixBSR (R));
+      if (N->memory() < memlimit) {
+        N->assemble();
+      } else {
+        INFO("block-sparse normal matrix exceeds memory limit (" + str(N->memory() >> 20) + " MB); using matrix-free operator.");
+        N.reset();
+      }
+    }
+    if (N)
+      x = solve_cg(*N, b, x0, tol, maxiter, precond, deflate ? &subspace : nullptr, nsub);
+    else
+      x = solve_cg(R.normal(), b, x0, tol, maxiter, precond, deflate ? &subspace : nullptr, nsub);
+  }
+  else if (solver > 1) {
+    DWI::SVR::LeastSquaresSolver ls (R, (solver == 2) ? DWI::SVR::LeastSquaresSolver::LSQR
+                                                      : DWI::SVR::LeastSquaresSolver::LSMR);
+    ls.setTolerance(tol);
+    ls.setStepTolerance(get_option_value("xtol", 0.0f));
+    ls.setMaxIterations(maxiter);
+    opt = get_options("mask");
+    if (opt.size()) {
+      auto mask = Image<bool>::open(opt[0][0]);
+      check_dimensions(rechdr, mask, 0, 3);
+      Eigen::VectorXf m (voxel_count(rechdr, 0, 3));
+      size_t j = 0;
+      for (auto l = Loop("loading mask", {0, 1, 2})(mask); l; l++, j++)
+        m[j] = mask.value();
+      ls.setMask(m);
+    }
+    x = ls.solveWithGuess(y, x0);
+    CONSOLE(std::string(solvers[solver]) + ": #iterations: " + str(ls.iterations()));
+    CONSOLE(std::string(solvers[solver]) + ": estimated error: " + str(ls.error()));
+  }
+  else {
+    if (precond == 1)
+      x = solve_lscg<DWI::SVR::JacobiPreconditioner>(R, y, x0, tol, maxiter);
+    else if (precond == 2)
+      x = solve_lscg<DWI::SVR::BlockJacobiPreconditioner>(R, y, x0, tol, maxiter);
+    else
+      x = solve_lscg<Eigen::IdentityPreconditioner>(R, y, x0, tol, maxiter);
+  }
 
 
   // Write result to output file
@@ -358,7 +650,11 @@ void run ()
   msshhdr.ndim() = 5;
   msshhdr.size(3) = shells.count();
   msshhdr.size(4) = padding;
-  Stride::set_from_command_line (msshhdr, {3, 4, 5, 2, 1});
+  if (nboot) {
+    msshhdr.ndim() = 6;
+    msshhdr.size(5) = nboot;
+  }
+  Stride::set_from_command_line (msshhdr, {3, 4, 5, 2, 1, 6});
   msshhdr.datatype() = DataType::from_command_line (DataType::Float32);
   PhaseEncoding::set_scheme (msshhdr, Eigen::MatrixXf());
   // store b-values and counts
@@ -380,15 +676,43 @@ void run ()
 
   auto out = Image<value_type>::create (argument[1], msshhdr);
 
-  j = 0;
   Eigen::VectorXf c (ncoefs);
   Eigen::VectorXf sh (padding); sh.setZero();
-  for (auto l = Loop("writing result to image", {0, 1, 2})(out); l; l++, j+=ncoefs) {
-    c = x.segment(j, ncoefs);
-    for (int k = 0; k < shells.count(); k++) {
-      out.index(3) = k;
-      sh.head(Math::SH::NforL(lmax)) = qbasis.getShellBasis(k).transpose() * c;
-      out.row(4) = sh;
+  for (size_t r = 0; r < std::max(nboot, size_t(1)); r++) {
+    if (nboot) {
+      out.index(5) = r;
+      x = xboot.col(r);
+    }
+    j = 0;
+    for (auto l = Loop("writing result to image", {0, 1, 2})(out); l; l++, j+=ncoefs) {
+      c = x.segment(j, ncoefs);
+      for (int k = 0; k < shells.count(); k++) {
+        out.index(3) = k;
+        sh.head(Math::SH::NforL(lmax)) = qbasis.getShellBasis(k).transpose() * c;
+        out.row(4) = sh;
+      }
+    }
+  }
+
+
+  // Export deflation subspace
+  opt = get_options("subspace_out");
+  if (opt.size()) {
+    Header subhdr (msshhdr);
+    subhdr.ndim() = 6;
+    subhdr.size(5) = subspace.cols();
+    Stride::set (subhdr, {3, 4, 5, 2, 1, 6});
+    auto sub = Image<value_type>::create (opt[0][0], subhdr);
+    for (auto l0 = Loop("writing deflation subspace", 5)(sub); l0; l0++) {
+      j = 0;
+      for (auto l = Loop(0, 3)(sub); l; l++, j+=ncoefs) {
+        c = subspace.col(sub.index(5)).segment(j, ncoefs);
+        for (int k = 0; k < shells.count(); k++) {
+          sub.index(3) = k;
+          sh.head(Math::SH::NforL(lmax)) = qbasis.getShellBasis(k).transpose() * c;
+          sub.row(4) = sh;
+        }
+      }
     }
   }
 
@@ -32,6 +32,9 @@ using namespace MR;
 using namespace App;
 
 
+const char* const interps[] = { "linear", "cubic", nullptr };
+
+
 void usage ()
 {
   AUTHOR = "Daan Christiaens (daan.christiaens@kcl.ac.uk)";
@@ -67,6 +70,11 @@ void usage ()
                    "Gaussian SSP, relative to the voxel size. (default = " + str(DEFAULT_SSPW)  + ")")
     + Argument ("w").type_text()
 
+  + Option ("interp", "the interpolation kernel of the recon operator: linear or cubic. Linear "
+                      "interpolation takes 8 instead of 64 recon voxels per sample, for cheaper "
+                      "but blurrier reconstructions. (default = cubic)")
+    + Argument ("kernel").type_choice(interps)
+
   + Option ("field", "Static susceptibility field, aligned in recon space.")
     + Argument ("map").type_image_in()
     + Argument ("idx").type_integer()
@@ -207,7 +215,8 @@ void run ()
     }
 
 
-    DWI::SVR::ReconMapping map (recon, dwi, qbasis, motion, ssp);
+    DWI::SVR::ReconMapping map (recon, dwi, qbasis, motion, ssp,
+                                DWI::SVR::InterpKernel(get_option_value("interp", int(DWI::SVR::INTERP_CUBIC))));
 
 
     Header header (dwi);
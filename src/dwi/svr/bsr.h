@@ -0,0 +1,365 @@
+/* Copyright (c) 2017-2019 Daan Christiaens
+ *
+ * MRtrix and this add-on module are distributed in the hope
+ * that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __dwi_svr_bsr_h__
+#define __dwi_svr_bsr_h__
+
+
+#include <algorithm>
+#include <limits>
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+#include "types.h"
+#include "header.h"
+#include "thread.h"
+#include "algo/threaded_loop.h"
+
+#include "dwi/svr/recon.h"
+
+
+namespace MR
+{
+  namespace DWI {
+    namespace SVR {
+      class ReconMatrixBSR;
+    }
+  }
+}
+
+
+namespace Eigen {
+  namespace internal {
+    template<>
+    struct traits<MR::DWI::SVR::ReconMatrixBSR> : public Eigen::internal::traits<Eigen::SparseMatrix<float,Eigen::ColMajor> >
+    {};
+  }
+}
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace SVR
+    {
+
+    /**
+     *  Normal matrix R^T R of the reconstruction, with the data term assembled once in block-
+     *  sparse row (BSR) format. Each recon voxel couples to its neighbours within the footprint
+     *  of the source slices through ncoefs x ncoefs blocks. The constructor finds the nonzero
+     *  blocks of every row in a symbolic pass over the shot footprints, with their neighbour
+     *  offsets taken from a stencil that is shared by all voxels; assemble() then computes
+     *  only these blocks. The regularisers are applied matrix-free.
+     *
+     *  This pays off only when the motion and weights are fixed across many CG iterations and
+     *  the matrix fits in memory; check memory() before assemble().
+     */
+    class ReconMatrixBSR : public Eigen::EigenBase<ReconMatrixBSR>
+    {  MEMALIGN(ReconMatrixBSR);
+    public:
+      // Required typedefs, constants, and method:
+      typedef float Scalar;
+      typedef float RealScalar;
+      typedef int StorageIndex;
+      enum {
+        ColsAtCompileTime = Eigen::Dynamic,
+        MaxColsAtCompileTime = Eigen::Dynamic,
+        IsRowMajor = false
+      };
+
+      Eigen::Index rows() const { return recmat.cols(); }
+      Eigen::Index cols() const { return recmat.cols(); }
+
+      template<typename Rhs>
+      Eigen::Product<ReconMatrixBSR,Rhs,Eigen::AliasFreeProduct> operator*(const Eigen::MatrixBase<Rhs>& x) const {
+        return Eigen::Product<ReconMatrixBSR,Rhs,Eigen::AliasFreeProduct>(*this, x.derived());
+      }
+
+      using RowMatrixXf = ReconMatrix::RowMatrixXf;
+      using BlockMatrixXf = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+      // Custom API:
+      ReconMatrixBSR(const ReconMatrix& m)
+        : recmat (m), map (m.mapping()),
+          nc (map.xheader().size(3))
+      {
+        for (size_t k = 0; k < 3; k++)
+          dim[k] = map.xheader().size(k);
+        init_stencil(radius(map));
+        analyse();
+      }
+
+      const ReconMatrix& matrix() const { return recmat; }
+
+      //! memory use of the assembled matrix, in bytes
+      size_t memory() const
+      {
+        return colidx.size() * (nc*nc*sizeof(float) + sizeof(uint32_t)) + rowptr.size() * sizeof(size_t);
+      }
+
+      void assemble()
+      {
+        INFO("Assembling block-sparse normal matrix (" + str(colidx.size()) + " blocks).");
+        blocks.assign(colidx.size() * nc * nc, 0.0f);
+        accumulate("assembling normal matrix", false);
+      }
+
+      template <typename VectorType1, typename VectorType2>
+      void project(VectorType1& dst, const VectorType2& rhs) const
+      {
+        INFO("Normal projection (BSR).");
+        Eigen::VectorXf copy = rhs;
+        size_t nxyz = dim[0]*dim[1]*dim[2];
+        Eigen::Map<RowMatrixXf> Y (dst.data(), nxyz, nc);
+        Eigen::Map<const RowMatrixXf> X (copy.data(), nxyz, nc);
+        struct BlockProduct {   MEMALIGN(BlockProduct);
+          const ReconMatrixBSR& M;
+          Eigen::Map<RowMatrixXf> Y;
+          Eigen::Map<const RowMatrixXf> X;
+          void operator() (Iterator& pos) {
+            const ssize_t y = pos.index(1), z = pos.index(2);
+            for (ssize_t x = 0; x < M.dim[0]; x++) {
+              size_t j = M.index(x, y, z);
+              for (size_t k = M.rowptr[j]; k < M.rowptr[j+1]; k++) {
+                const auto& d = M.offsets[M.colidx[k]];
+                Y.row(j) += X.row(M.index(x+d[0], y+d[1], z+d[2])) * M.block(k);
+              }
+            }
+          }
+        } func = {*this, Y, X};
+        ThreadedLoop (map.xheader(), vector<size_t>({1, 2}), vector<size_t>({0})).run_outer (func);
+        INFO("Normal projection - regularisers");
+        recmat.regularisers_normal_add(dst, copy);
+      }
+
+    private:
+      const ReconMatrix& recmat;
+      const ReconMapping& map;
+      const size_t nc;
+      ssize_t dim[3];
+      std::array<ssize_t,3> rad;
+      vector<std::array<ssize_t,3>> offsets;
+      vector<size_t> rowptr;      // first block of every recon voxel
+      vector<uint32_t> colidx;    // stencil offset of every block
+      vector<float> blocks;
+      size_t nwords;
+      vector<uint64_t> pattern;   // nonzero offsets of every recon voxel, during analyse()
+
+      FORCE_INLINE size_t index(ssize_t x, ssize_t y, ssize_t z) const {
+        return (z*dim[1] + y)*dim[0] + x;
+      }
+
+      FORCE_INLINE size_t offset(ssize_t dx, ssize_t dy, ssize_t dz) const {
+        return ((dz+rad[2])*(2*rad[1]+1) + dy+rad[1])*(2*rad[0]+1) + dx+rad[0];
+      }
+
+      FORCE_INLINE Eigen::Map<const BlockMatrixXf> block(size_t k) const {
+        return Eigen::Map<const BlockMatrixXf> (blocks.data() + k*nc*nc, nc, nc);
+      }
+
+      // Half-width of the stencil along each axis: the cubic support plus the extent
+      // of the SSP along the slice normal in recon space, maximised over all shots.
+      static std::array<ssize_t,3> radius(const ReconMapping& map)
+      {
+        auto fp = map.footprint();
+        Eigen::Vector3d dmax (0.0, 0.0, 0.0);
+        size_t nshots = map.yheader().size(3) * map.excitations();
+        for (size_t idx = 0; idx < nshots; idx++) {
+          fp.set_shotidx(idx);
+          dmax = dmax.cwiseMax(fp.transform().linear().col(2).cwiseAbs());
+        }
+        int n = fp.ssp_size();
+        std::array<ssize_t,3> r;
+        for (size_t k = 0; k < 3; k++)
+          r[k] = std::min(ssize_t(3 + std::ceil(2*n*dmax[k])), ssize_t(map.xheader().size(k)-1));
+        return r;
+      }
+
+      void init_stencil(const std::array<ssize_t,3>& r)
+      {
+        rad = r;
+        for (ssize_t dz = -rad[2]; dz <= rad[2]; dz++)
+          for (ssize_t dy = -rad[1]; dy <= rad[1]; dy++)
+            for (ssize_t dx = -rad[0]; dx <= rad[0]; dx++)
+              offsets.push_back({dx, dy, dz});
+        DEBUG("BSR stencil radius " + str(rad[0]) + "," + str(rad[1]) + "," + str(rad[2]));
+      }
+
+      /* Assemble R^T W R. Within one shot, all source voxels share the same q-space
+       * projection q, so the scalar spatial couplings are accumulated per shot job (see
+       * ReconMapping::schedule()) and expanded into blocks S_jk q q^T on write-back. The
+       * couplings are kept in a sparse row buffer, with the noff offsets of a recon voxel
+       * in a row that is assigned on first use, so it scales with the footprint of the job.
+       * The row of each recon voxel is looked up in a dense per-thread slot index. In the
+       * symbolic pass, the write-back only marks the nonzero couplings in the pattern. */
+      struct Assembler {   MEMALIGN(Assembler);
+        Assembler (ReconMatrixBSR& M, const Eigen::MatrixXf& W, const Eigen::VectorXf& Wvox, Adapter::RowLocks* lock, bool symbolic)
+          : M (M), fp (M.map.footprint()), W (W), Wvox (Wvox), lock (lock), noff (M.offsets.size()), symbolic (symbolic),
+            slots (make_slots(voxel_count(M.map.xheader(), 0, 3))) { }
+
+        void operator() (const ShotJob& job) {
+          const size_t ne = M.map.excitations(), v = job.v;
+          const ssize_t nx = M.map.yheader().size(0), ny = M.map.yheader().size(1), nz = M.map.yheader().size(2);
+          fp.set_shotidx(job.shot);
+          for (ssize_t zz = job.first; zz < ssize_t(job.last); zz += ne) {
+            if (W(zz,v) == 0.0f) continue;
+            size_t j = (v*nz + zz)*nx*ny;
+            for (ssize_t y = 0; y < ny; y++)
+              for (ssize_t x = 0; x < nx; x++, j++)
+                if (Wvox[j] != 0.0f) add(x, y, zz, W(zz,v) * Wvox[j]);
+          }
+          flush(M.map.basis().get_projection(job.shot));
+        }
+
+        private:
+          struct Entry { ssize_t x, y, z; size_t j; float w; };
+          ReconMatrixBSR& M;
+          MotionFootprint fp;
+          const Eigen::MatrixXf& W;
+          const Eigen::VectorXf& Wvox;
+          Adapter::RowLocks* lock;
+          const size_t noff;
+          const bool symbolic;
+          enum : uint32_t { none = std::numeric_limits<uint32_t>::max() };
+          ThreadLocal<vector<uint32_t>> slots;    // recon voxel -> row of S, or none
+          vector<size_t> rows;                    // row of S -> recon voxel
+          vector<float> S;                        // noff couplings per row
+          vector<Entry> entries;
+
+          static std::function<vector<uint32_t>()> make_slots (size_t nxyz) {
+            return [nxyz] () { return vector<uint32_t> (nxyz, none); };
+          }
+
+          FORCE_INLINE float* row (size_t j) {
+            uint32_t& s = (*slots)[j];
+            if (s == none) {
+              s = rows.size();
+              rows.push_back(j);
+              S.resize(rows.size()*noff, 0.0f);
+            }
+            return S.data() + size_t(s)*noff;
+          }
+
+          void add (ssize_t x, ssize_t y, ssize_t z, float ws) {
+            entries.clear();
+            fp(x, y, z, [&](ssize_t i, ssize_t j, ssize_t k, float w) {
+              entries.push_back({i, j, k, M.index(i, j, k), w});
+            });
+            // merge repeated voxels
+            std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.j < b.j; });
+            size_t n = 0;
+            for (size_t i = 1; i < entries.size(); i++) {
+              if (entries[i].j == entries[n].j) entries[n].w += entries[i].w;
+              else entries[++n] = entries[i];
+            }
+            entries.resize(n+1);
+            // accumulate pairwise couplings
+            for (const auto& a : entries) {
+              float* Sa = row(a.j);
+              for (const auto& b : entries)
+                Sa[M.offset(b.x-a.x, b.y-a.y, b.z-a.z)] += ws * a.w * b.w;
+            }
+          }
+
+          void flush (const Eigen::Ref<const Eigen::VectorXf>& q) {
+            const BlockMatrixXf Q = symbolic ? BlockMatrixXf() : BlockMatrixXf (q * q.transpose());
+            for (size_t r = 0; r < rows.size(); r++) {
+              const size_t j = rows[r];
+              (*slots)[j] = none;
+              Adapter::RowLock guard (*lock, j);
+              if (symbolic) {
+                uint64_t* p = M.pattern.data() + j*M.nwords;
+                for (size_t o = 0; o < noff; o++)
+                  if (S[r*noff+o] != 0.0f) p[o >> 6] |= uint64_t(1) << (o & 63);
+                continue;
+              }
+              // the offsets of row j are sorted, and so are its blocks
+              size_t k = M.rowptr[j];
+              for (size_t o = 0; o < noff; o++) {
+                const float s = S[r*noff+o];
+                if (s == 0.0f) continue;
+                while (M.colidx[k] < o) k++;
+                assert (k < M.rowptr[j+1] && M.colidx[k] == o);
+                Eigen::Map<BlockMatrixXf> (M.blocks.data() + k*M.nc*M.nc, M.nc, M.nc) += s * Q;
+              }
+            }
+            rows.clear();
+            S.clear();
+          }
+      };
+
+      void accumulate (const std::string& msg, bool symbolic)
+      {
+        const std::shared_ptr<Adapter::RowLocks> lock = map.locks();
+        Assembler func (*this, recmat.getWeights(), recmat.getVoxelWeights(), lock.get(), symbolic);
+        run_shots (msg, map.schedule(&recmat.getWeights(), &recmat.getVoxelWeights()), func);
+      }
+
+      // Find the nonzero blocks of every row, as a bit pattern over the stencil offsets,
+      // and compress it to the row pointers and sorted offsets of the blocks.
+      void analyse()
+      {
+        const size_t nxyz = dim[0]*dim[1]*dim[2], noff = offsets.size();
+        nwords = (noff + 63) / 64;
+        pattern.assign(nxyz * nwords, 0);
+        accumulate("analysing normal matrix", true);
+        rowptr.assign(nxyz+1, 0);
+        for (size_t j = 0; j < nxyz; j++) {
+          const uint64_t* p = pattern.data() + j*nwords;
+          size_t n = 0;
+          for (size_t o = 0; o < noff; o++)
+            n += (p[o >> 6] >> (o & 63)) & 1;
+          rowptr[j+1] = rowptr[j] + n;
+        }
+        colidx.resize(rowptr[nxyz]);
+        for (size_t j = 0, k = 0; j < nxyz; j++) {
+          const uint64_t* p = pattern.data() + j*nwords;
+          for (size_t o = 0; o < noff; o++)
+            if ((p[o >> 6] >> (o & 63)) & 1) colidx[k++] = o;
+        }
+        vector<uint64_t>().swap(pattern);
+        INFO("Block-sparse normal matrix: " + str(colidx.size()) + " nonzero blocks, "
+             + str(float(colidx.size()) / nxyz) + " per voxel (stencil of " + str(noff) + ").");
+      }
+
+    };
+
+
+    }
+  }
+}
+
+
+// Implementation of ReconMatrixBSR * Eigen::DenseVector though a specialization of internal::generic_product_impl:
+namespace Eigen {
+  namespace internal {
+
+    template<typename Rhs>
+    struct generic_product_impl<MR::DWI::SVR::ReconMatrixBSR, Rhs, SparseShape, DenseShape, GemvProduct>
+      : generic_product_impl_base<MR::DWI::SVR::ReconMatrixBSR,Rhs,generic_product_impl<MR::DWI::SVR::ReconMatrixBSR,Rhs> >
+    {
+      typedef typename Product<MR::DWI::SVR::ReconMatrixBSR,Rhs>::Scalar Scalar;
+
+      template<typename Dest>
+      static void scaleAndAddTo(Dest& dst, const MR::DWI::SVR::ReconMatrixBSR& lhs, const Rhs& rhs, const Scalar& alpha)
+      {
+        // This method should implement "dst += alpha * lhs * rhs" inplace
+        assert(alpha==Scalar(1) && "scaling is not implemented");
+
+        lhs.project<Dest, Rhs>(dst, rhs);
+
+      }
+    };
+
+  }
+}
+
+
+#endif
+
@@ -10,6 +10,10 @@
 #define __dwi_svr_mapping_h__
 
 
+#include <array>
+#include <functional>
+#include <map>
+#include <limits>
 #include <Eigen/Dense>
 #include <Eigen/Sparse>
 
@@ -21,12 +25,19 @@
 #include "dwi/shells.h"
 #include "interp/linear.h"
 #include "interp/cubic.h"
+#include "thread.h"
 #include "algo/threaded_loop.h"
 
 #include "dwi/svr/param.h"
 #include "dwi/svr/psf.h"
 #include "dwi/svr/qspacebasis.h"
 
+#define DEFAULT_PULL_BLOCK 16
+#define DEFAULT_SCHED_CHUNKS 4
+#define FOOTPRINT_BLOCK 8
+#define DEFAULT_GROUP_QUANT 1e-6
+#define DEFAULT_SLICE_TILE 16
+
 
 namespace MR
 {
@@ -105,88 +116,561 @@ namespace MR
     namespace SVR
     {
 
-      template <class ImageType>
-      class MotionMapping : public Adapter::Base<MotionMapping<ImageType>, ImageType>
+      //! interpolation kernel of the recon operator
+      enum InterpKernel { INTERP_LINEAR, INTERP_CUBIC };
+
+
+      /* Cubic (Catmull-Rom) interpolation weights, as used in Interp::Cubic. */
+      FORCE_INLINE void cubic_weights (const default_type t, float w[4])
+      {
+        const default_type t2 = t*t, t3 = t2*t;
+        w[0] = -0.5*t3 + t2 - 0.5*t;
+        w[1] = 1.5*t3 - 2.5*t2 + 1.0;
+        w[2] = -1.5*t3 + 2.0*t2 + 0.5*t;
+        w[3] = 0.5*t3 - 0.5*t2;
+      }
+
+
+      /* Scratch arrays of M entries per SSP tap, for 2H+1 taps: on the stack for a fixed no.
+       * taps, and for H = -1 in a heap buffer of the caller, which is grown as needed. */
+      template <class T, int H, int M = 1>
+      struct TapArray
+      {
+        template <class Heap>
+        TapArray (Heap&, size_t) { }
+        FORCE_INLINE T* data () { return a.data(); }
+        FORCE_INLINE T& operator[] (size_t i) { return a[i]; }
+        std::array<T, M*(2*H+1)> a;
+      };
+
+      template <class T, int M>
+      struct TapArray<T, -1, M>
+      {
+        template <class Heap>
+        TapArray (Heap& heap, size_t ntaps) {
+          if (heap.size() < M*ntaps) heap.resize(M*ntaps);
+          p = heap.data();
+        }
+        FORCE_INLINE T* data () { return p; }
+        FORCE_INLINE T& operator[] (size_t i) { return p[i]; }
+        T* p;
+      };
+
+
+      /**
+       *  Footprint of a source voxel in recon space, i.e., the recon voxels and weights
+       *  (cubic or linear interpolation x SSP) that MotionMapping combines into its prediction.
+       *  Unlike MotionMapping, this needs no image data.
+       *
+       *  The kernels are specialised for SSPs of 1, 3 and 5 taps (H = 0, 1, 2 in taps<H>()),
+       *  with the loops over the taps unrolled, their scratch arrays on the stack and the SSP
+       *  as a FixedSSP<H> (see TapSSP). H = -1 works for any SSP. operator() and row() select
+       *  the specialisation on every call; callers that evaluate many footprints can select
+       *  it once and call taps<H>() with their own TapSSP<H> (see MotionMapping).
+       */
+      class MotionFootprint
+      {
+        MEMALIGN (MotionFootprint)
+        public:
+          MotionFootprint (const Header& recon, const Header& source,
+                           const Eigen::MatrixXf& rigid, const SSP<float>& ssp,
+                           const InterpKernel kernel = INTERP_CUBIC)
+            : motion (rigid), ssp (ssp), Tr (recon), Ts (source),
+              Ts2r (Tr.scanner2voxel * Ts.voxel2scanner), K ((kernel == INTERP_LINEAR) ? 2 : 4)
+          {
+            for (size_t k = 0; k < 3; k++)
+              dim[k] = recon.size(k);
+            aligned = check_aligned();
+          }
+
+          void set_shotidx (size_t idx) {
+            Ts2r = Tr.scanner2voxel * get_transform(motion.row(idx)) * Ts.voxel2scanner;
+            aligned = check_aligned();
+          }
+
+          //! vox-to-vox transform of the current shot
+          const transform_type& transform () const { return Ts2r; }
+
+          //! true if the source grid of the current shot is an integer shift of the recon grid
+          bool grid_aligned () const { return aligned; }
+
+          //! maximum no. recon voxels in the footprint
+          size_t size () const { return K*K*K * (2*ssp.size()+1); }
+
+          //! interpolation kernel
+          InterpKernel kernel () const { return (K == 2) ? INTERP_LINEAR : INTERP_CUBIC; }
+
+          //! half-width of the SSP, in source voxels
+          int ssp_size () const { return ssp.size(); }
+
+          //! call f(x, y, z, weight) for every recon voxel in the footprint of source voxel (i, j, k)
+          template <class Functor>
+          void operator() (ssize_t i, ssize_t j, ssize_t k, Functor&& f)
+          {
+            SpecialiseTaps::run (ssp.size(), Voxel<Functor> {*this, i, j, k, f});
+          }
+
+          //! as operator(), with sp the SSP of this footprint as a TapSSP<H>
+          template <int H, class Functor>
+          FORCE_INLINE void taps (const TapSSP<H>& sp, ssize_t i, ssize_t j, ssize_t k, Functor&& f)
+          {
+            if (aligned)
+              return shifted(i, j, k, f);
+            evaluate<H> (sp, i, j, k, f);
+          }
+
+          /**
+           * call f(n, x, y, z, weight) for every recon voxel in the footprints of the source
+           * voxels (i0+n, j, k), 0 <= n < len, in the same order as operator(). Positions step
+           * along the row, and the interpolation weights are evaluated for blocks of
+           * FOOTPRINT_BLOCK voxels at once, in fixed-size arrays that the compiler vectorises.
+           */
+          template <class Functor>
+          void row (ssize_t i0, ssize_t len, ssize_t j, ssize_t k, Functor&& f)
+          {
+            if (aligned) {
+              for (ssize_t n = 0; n < len; n++)
+                shifted(i0 + n, j, k, [&](ssize_t x, ssize_t y, ssize_t z, float wt) { f(n, x, y, z, wt); });
+              return;
+            }
+            SpecialiseTaps::run (ssp.size(), Row<Functor> {*this, i0, len, j, k, f});
+          }
+
+        private:
+          const Eigen::MatrixXf motion;
+          const SSP<float> ssp;
+          const Transform Tr, Ts;
+          transform_type Ts2r;
+          ssize_t dim[3];
+          const ssize_t K;          // kernel support: 4 (cubic) or 2 (linear)
+          bool aligned;             // Ts2r is an integer translation
+          ssize_t shift[3];         // ... by this many recon voxels
+
+          using Corners = Eigen::Array<ssize_t, FOOTPRINT_BLOCK, 3>;
+          using Weights = Eigen::Array<float, FOOTPRINT_BLOCK, 4>;
+
+          // heap scratch of the kernels for any SSP (H = -1), which is why the kernels are
+          // not const: every thread evaluates its own copy of the footprint
+          vector<ssize_t> tapc;
+          vector<float> tapw;
+          vector<Corners, Eigen::aligned_allocator<Corners>> rowc;
+          vector<Weights, Eigen::aligned_allocator<Weights>> roww;
+          vector<float> box;
+
+          template <class Functor>
+          struct Voxel {   NOMEMALIGN
+            MotionFootprint& fp;
+            ssize_t i, j, k;
+            Functor& f;
+            template <int H> void run () { const TapSSP<H>& sp = fp.ssp; fp.taps<H> (sp, i, j, k, f); }
+          };
+
+          template <class Functor>
+          struct Row {   NOMEMALIGN
+            MotionFootprint& fp;
+            ssize_t i0, len, j, k;
+            Functor& f;
+            template <int H> void run () { const TapSSP<H>& sp = fp.ssp; fp.evaluate_row<H> (sp, i0, len, j, k, f); }
+          };
+
+          template <int H, class Functor>
+          void evaluate (const TapSSP<H>& sp, ssize_t i, ssize_t j, ssize_t k, Functor&& f)
+          {
+            const int h = sp.size();
+            TapArray<ssize_t, H, 3> c (tapc, 2*h+1);
+            TapArray<float, H, 12> w (tapw, 2*h+1);
+            Eigen::Vector3d pr = Ts2r * Eigen::Vector3d (i, j, k - h);
+            for (int s = 0; s <= 2*h; s++, pr += Ts2r.linear().col(2)) {
+              for (size_t n = 0; n < 3; n++) {
+                default_type p = (pr[n] < 0) ? 0 : (pr[n] > dim[n]-1) ? dim[n]-1 : pr[n];
+                default_type p0 = std::floor(p);
+                if (K == 4) {
+                  c[3*s+n] = ssize_t(p0) - 1;
+                  cubic_weights(p - p0, &w[12*s+4*n]);
+                } else {
+                  c[3*s+n] = ssize_t(p0);
+                  w[12*s+4*n] = 1.0 - (p - p0);
+                  w[12*s+4*n+1] = p - p0;
+                }
+              }
+            }
+            combine<H> (sp, c.data(), w.data(), f);
+          }
+
+          template <int H, class Functor>
+          void evaluate_row (const TapSSP<H>& sp, ssize_t i0, ssize_t len, ssize_t j, ssize_t k, Functor&& f)
+          {
+            using Block = Eigen::Array<double, FOOTPRINT_BLOCK, 1>;
+            const size_t ntaps = 2*sp.size()+1;
+            TapArray<Corners, H> c (rowc, ntaps);
+            TapArray<Weights, H, 3> w (roww, ntaps);
+            TapArray<ssize_t, H, 3> tc (tapc, ntaps);
+            TapArray<float, H, 12> tw (tapw, ntaps);
+            const Block ramp = Block::LinSpaced(FOOTPRINT_BLOCK, 0, FOOTPRINT_BLOCK-1);
+            for (ssize_t n0 = 0; n0 < len; n0 += FOOTPRINT_BLOCK) {
+              Eigen::Vector3d pr = Ts2r * Eigen::Vector3d (i0 + n0, j, k - sp.size());
+              for (size_t s = 0; s < ntaps; s++, pr += Ts2r.linear().col(2)) {
+                for (size_t n = 0; n < 3; n++) {
+                  Block p = (pr[n] + Ts2r.linear()(n,0) * ramp).max(0.0).min(dim[n]-1.0);
+                  Block p0 = p.floor();
+                  Eigen::Array<float, FOOTPRINT_BLOCK, 1> t = (p - p0).cast<float>(), t2 = t*t, t3 = t2*t;
+                  Weights& wn = w[3*s+n];
+                  if (K == 4) {
+                    c[s].col(n) = p0.cast<ssize_t>() - 1;
+                    wn.col(0) = -0.5f*t3 + t2 - 0.5f*t;
+                    wn.col(1) = 1.5f*t3 - 2.5f*t2 + 1.0f;
+                    wn.col(2) = -1.5f*t3 + 2.0f*t2 + 0.5f*t;
+                    wn.col(3) = 0.5f*t3 - 0.5f*t2;
+                  } else {
+                    c[s].col(n) = p0.cast<ssize_t>();
+                    wn.col(0) = 1.0f - t;
+                    wn.col(1) = t;
+                  }
+                }
+              }
+              for (ssize_t m = 0; m < std::min(ssize_t(FOOTPRINT_BLOCK), len - n0); m++) {
+                for (size_t s = 0; s < ntaps; s++) {
+                  for (size_t n = 0; n < 3; n++) {
+                    tc[3*s+n] = c[s](m,n);
+                    for (size_t q = 0; q < 4; q++)
+                      tw[12*s+4*n+q] = w[3*s+n](m,q);
+                  }
+                }
+                combine<H> (sp, tc.data(), tw.data(), [&](ssize_t x, ssize_t y, ssize_t z, float wt) { f(n0 + m, x, y, z, wt); });
+              }
+            }
+          }
+
+          // without motion (and on the source grid), all interpolation weights but one are zero
+          bool check_aligned () {
+            if (!Ts2r.linear().isIdentity(1e-6))
+              return false;
+            for (size_t n = 0; n < 3; n++) {
+              shift[n] = std::lround(Ts2r.translation()[n]);
+              if (std::abs(Ts2r.translation()[n] - shift[n]) > 1e-6)
+                return false;
+            }
+            return true;
+          }
+
+          // footprint of an aligned shot: a pure z-convolution with the SSP
+          template <class Functor>
+          FORCE_INLINE void shifted (ssize_t i, ssize_t j, ssize_t k, Functor&& f) const
+          {
+            const ssize_t x = clamp(i + shift[0], 0), y = clamp(j + shift[1], 1);
+            for (int s = -ssp.size(); s <= ssp.size(); s++)
+              f(x, y, clamp(k + s + shift[2], 2), ssp(s));
+          }
+
+          FORCE_INLINE transform_type get_transform(const Eigen::VectorXf& p) const {
+            transform_type T (se3exp(p).cast<double>());
+            return T;
+          }
+
+          FORCE_INLINE ssize_t clamp (ssize_t r, size_t axis) const {
+            return (r < 0) ? 0 : (r >= dim[axis]) ? dim[axis]-1 : r;
+          }
+
+          /* Call f(x, y, z, weight) for the footprint of the taps of SSP sp with corners tc and
+           * cubic weights tw. A single tap gives the K^3 voxels of the interpolation kernel. Several
+           * taps overlap along the slice normal, so they are first summed into one composite
+           * SSP x interpolation kernel on their bounding box, and every recon voxel is visited
+           * once, with the weights of all taps combined. */
+          template <int H, class Functor>
+          FORCE_INLINE void combine (const TapSSP<H>& sp, const ssize_t* tc, const float* tw, Functor&& f)
+          {
+            const int ntaps = 2*sp.size()+1;
+            if (ntaps == 1) {
+              const ssize_t* c = tc;
+              const float* w = tw;
+              for (ssize_t z = 0; z < K; z++) {
+                ssize_t zz = clamp(c[2] + z, 2);
+                float wz = sp(0) * w[8+z];
+                for (ssize_t y = 0; y < K; y++) {
+                  ssize_t yy = clamp(c[1] + y, 1);
+                  float wy = wz * w[4+y];
+                  for (ssize_t x = 0; x < K; x++)
+                    f(clamp(c[0] + x, 0), yy, zz, wy * w[x]);
+                }
+              }
+              return;
+            }
+            ssize_t lo[3], d[3];
+            for (size_t n = 0; n < 3; n++) {
+              ssize_t hi = lo[n] = tc[n];
+              for (int s = 1; s < ntaps; s++) {
+                lo[n] = std::min(lo[n], tc[3*s+n]);
+                hi = std::max(hi, tc[3*s+n]);
+              }
+              d[n] = hi - lo[n] + K;
+            }
+            box.assign(d[0]*d[1]*d[2], 0.0f);
+            for (int s = 0; s < ntaps; s++) {
+              const ssize_t* c = tc + 3*s;
+              const float* w = tw + 12*s;
+              for (ssize_t z = 0; z < K; z++) {
+                float wz = sp(s - sp.size()) * w[8+z];
+                for (ssize_t y = 0; y < K; y++) {
+                  float wy = wz * w[4+y];
+                  float* b = box.data() + ((c[2]-lo[2]+z)*d[1] + (c[1]-lo[1]+y))*d[0] + (c[0]-lo[0]);
+                  for (ssize_t x = 0; x < K; x++)
+                    b[x] += wy * w[x];
+                }
+              }
+            }
+            const float* b = box.data();
+            for (ssize_t z = 0; z < d[2]; z++) {
+              ssize_t zz = clamp(lo[2] + z, 2);
+              for (ssize_t y = 0; y < d[1]; y++) {
+                ssize_t yy = clamp(lo[1] + y, 1);
+                for (ssize_t x = 0; x < d[0]; x++, b++)
+                  if (*b != 0.0f) f(clamp(lo[0] + x, 0), yy, zz, *b);
+              }
+            }
+          }
+      };
+
+
+      /**
+       *  Prediction of the source voxels from the recon image through the footprint of every
+       *  source voxel in recon space, i.e., the composite SSP x interpolation kernel of
+       *  MotionFootprint. The parent is only accessed through the footprint, so that this
+       *  adapter holds a single copy of it (and of the scratch buffers of a cached parent).
+       *  The footprint kernel is specialised for an SSP of 2H+1 taps, or any for H = -1.
+       */
+      template <class ImageType, int H = -1>
+      class MotionMapping : public Adapter::Base<MotionMapping<ImageType, H>, ImageType>
       {
-        MEMALIGN (MotionMapping<ImageType>)
+        MEMALIGN (MotionMapping)
         public:
-          using base_type = Adapter::Base<MotionMapping<ImageType>, ImageType>;
+          using base_type = Adapter::Base<MotionMapping<ImageType, H>, ImageType>;
           using value_type = typename ImageType::value_type;
           using vector_type = typename Eigen::Matrix<value_type, Eigen::Dynamic, 1>;
 
           using base_type::parent;
 
           MotionMapping (const ImageType& projection, const Header& source,
-                         const Eigen::MatrixXf& rigid, const SSP<float>& ssp)
-            : base_type (projection),
-              interp (projection, 0.0f), yhdr (source), motion (rigid), ssp (ssp),
-              Tr (projection), Ts (source), Ts2r (Ts.scanner2voxel * Tr.voxel2scanner)
+                         const Eigen::MatrixXf& rigid, const SSP<float>& ssp,
+                         const InterpKernel kernel = INTERP_CUBIC)
+            : base_type (projection), yhdr (source), sp (ssp),
+              fp (Header (projection), source, rigid, ssp, kernel)
           { }
 
           // Adapter attributes -----------------------------------------------
-          size_t ndim () const { return interp.ndim(); }
-          int size (size_t axis) const { return (axis < 3) ? yhdr.size(axis) : interp.size(axis); }
-          default_type spacing (size_t axis) const { return (axis < 3) ? yhdr.spacing(axis) : interp.spacing(axis); }
+          size_t ndim () const { return parent().ndim(); }
+          int size (size_t axis) const { return (axis < 3) ? yhdr.size(axis) : parent().size(axis); }
+          default_type spacing (size_t axis) const { return (axis < 3) ? yhdr.spacing(axis) : parent().spacing(axis); }
           const transform_type& transform () const { return yhdr.transform(); }
           const std::string& name () const { return yhdr.name(); }
 
           ssize_t get_index (size_t axis) const {
-            return (axis < 3) ? x[axis] : interp.index(axis);
+            return (axis < 3) ? x[axis] : parent().index(axis);
           }
           void move_index (size_t axis, ssize_t increment) {
             if (axis < 3) x[axis] += increment;
-            else interp.index(axis) += increment;
+            else parent().index(axis) += increment;
           }
           void reset () {
             x[0] = x[1] = x[2] = 0;
-            for (size_t n = 3; n < interp.ndim(); ++n)
-              interp.index(n) = 0;
+            for (size_t n = 3; n < parent().ndim(); ++n)
+              parent().index(n) = 0;
           }
           // ------------------------------------------------------------------
 
           value_type value () {
             value_type res = 0;
-            for (int z = -ssp.size(); z <= ssp.size(); z++) {
-              Eigen::Vector3d pr = Ts2r * Eigen::Vector3d (x[0], x[1], x[2] + z);
-              for (int k = 0; k < 3; k++) pr[k] = clampdim(pr[k], k);
-              interp.voxel (pr);
-              res += ssp(z) * interp.value();
-            }
+            fp.template taps<H> (sp, x[0], x[1], x[2], [&](ssize_t i, ssize_t j, ssize_t k, float w) {
+              parent().index(0) = i; parent().index(1) = j; parent().index(2) = k;
+              res += w * parent().value();
+            });
             return res;
           }
 
           void adjoint_add (value_type val) {
-            for (int z = -ssp.size(); z <= ssp.size(); z++) {
-              Eigen::Vector3d pr = Ts2r * Eigen::Vector3d (x[0], x[1], x[2] + z);
-              for (int k = 0; k < 3; k++) pr[k] = clampdim(pr[k], k);
-              interp.voxel (pr);
-              interp.adjoint_add(ssp(z) * val);
-            }
+            fp.template taps<H> (sp, x[0], x[1], x[2], [&](ssize_t i, ssize_t j, ssize_t k, float w) {
+              parent().index(0) = i; parent().index(1) = j; parent().index(2) = k;
+              parent().adjoint_add(w * val);
+            });
           }
 
           void set_shotidx (size_t idx) {
-            interp.set_shotidx(idx);
-            Ts2r = Tr.scanner2voxel * get_transform(motion.row(idx)) * Ts.voxel2scanner;
+            parent().set_shotidx(idx);
+            fp.set_shotidx(idx);
           }
 
         private:
-          Interp::CubicAdjoint<ImageType> interp;
           const Header& yhdr;
-          Eigen::MatrixXf motion;
-          SSP<float> ssp;
           ssize_t x[3];
-          const Transform Tr, Ts;
-          transform_type Ts2r;    // vox-to-vox transform, mapping vectors in source space to recon space
+          const TapSSP<H> sp;
+          MotionFootprint fp;     // composite SSP x interpolation kernel
 
-          FORCE_INLINE transform_type get_transform(const Eigen::VectorXf& p) const {
-            transform_type T (se3exp(p).cast<double>());
-            return T;
+      };
+
+      //! MotionMapping for an SSP of 2H+1 taps, as an adapter template of the image type only
+      template <int H>
+      struct MotionTaps
+      {
+        template <class ImageType>
+        using Mapping = MotionMapping<ImageType, H>;
+      };
+
+
+      /**
+       *  A unit of work in the projections: the slices first, first+ne, ... (< last) of one
+       *  shot, i.e., a multiband slice group or an excitation of a volume, or part of it.
+       */
+      struct ShotJob
+      {
+        size_t v, shot, first, last;
+        float cost;
+      };
+
+
+      /**
+       *  A unit of work in the grouped projections: source slice z of all shots in a group
+       *  with the same motion.
+       */
+      struct GroupJob
+      {
+        size_t group, z;
+        float cost;
+      };
+
+
+      /**
+       *  A unit of work in the lock-free transpose projection: the row of recon blocks that
+       *  starts at recon voxel (0, y, z).
+       */
+      struct BlockJob
+      {
+        ssize_t y, z;
+        float cost;
+      };
+
+
+      /**
+       *  Run func(job) for all jobs on all threads. Every thread works on its own copy of func
+       *  and takes the next job from a shared queue as soon as it is done with the previous
+       *  one, so that the jobs, sorted by decreasing cost, balance themselves over the threads.
+       */
+      template <class Job, class Functor>
+      void run_shots (const std::string& msg, const vector<Job>& jobs, const Functor& func)
+      {
+        std::atomic<size_t> next (0);
+        struct Worker {   MEMALIGN(Worker);
+          Functor func;
+          const vector<Job>& jobs;
+          std::atomic<size_t>& next;
+          void execute () {
+            size_t n;
+            while ((n = next.fetch_add(1)) < jobs.size())
+              func(jobs[n]);
+          }
+        } worker = {func, jobs, next};
+        Thread::run (Thread::multi (worker), msg);
+      }
+
+
+      /**
+       *  Scratch data of a functor that run_shots() or a ThreadedLoop copies to every thread.
+       *  The data are created with make() on first access, and copies of the functor start
+       *  out empty instead of duplicating (or sharing) the scratch of the original.
+       */
+      template <class T>
+      class ThreadLocal
+      {
+        MEMALIGN(ThreadLocal<T>)
+        public:
+          ThreadLocal (std::function<T()> make) : make (make) { }
+          ThreadLocal (const ThreadLocal& other) : make (other.make) { }
+
+          FORCE_INLINE T& operator* () {
+            if (!value) value.reset (new T (make()));
+            return *value;
+          }
+          FORCE_INLINE T* operator-> () { return &**this; }
+
+        private:
+          std::function<T()> make;
+          std::unique_ptr<T> value;
+      };
+
+
+      /**
+       *  Order of the recon voxels in the buffers of the projections. In bricked order, the
+       *  volume is split into bricks of bx x by x bz voxels (truncated at the edges), stored
+       *  one after another in x-y-z order, each with its voxels in x-y-z order and the
+       *  coefficients of every voxel innermost. The 4x4x4 voxels of a cubic stencil then fall
+       *  into a few bricks of nearby rows, also for rotated slices, instead of 16 rows spread
+       *  across the volume. Layers of bz planes remain contiguous. Without bricks (size 0),
+       *  this is the voxel-major order of the recon image.
+       */
+      class BrickLayout
+      {
+        MEMALIGN(BrickLayout)
+        public:
+          BrickLayout (const Header& recon, ssize_t bx = 0, ssize_t by = 0, ssize_t bz = 0)
+            : n {recon.size(0), recon.size(1), recon.size(2)}, b {bx, by, bz} { }
+
+          bool active () const { return b[0] > 0; }
+          ssize_t size (size_t axis) const { return b[axis]; }
+
+          //! row of recon voxel (x, y, z)
+          FORCE_INLINE size_t row (ssize_t x, ssize_t y, ssize_t z) const {
+            if (!active())
+              return (z*n[1] + y)*n[0] + x;
+            const ssize_t kx = x / b[0], ky = y / b[1], kz = z / b[2];
+            const ssize_t lx = std::min(b[0], n[0] - kx*b[0]), ly = std::min(b[1], n[1] - ky*b[1]),
+                          lz = std::min(b[2], n[2] - kz*b[2]);
+            return (kz*b[2]*n[1] + ky*b[1]*lz)*n[0] + kx*b[0]*ly*lz
+                 + ((z - kz*b[2])*ly + (y - ky*b[1]))*lx + (x - kx*b[0]);
+          }
+
+          //! recon voxel (x, y, z) in row r
+          FORCE_INLINE void voxel (size_t r, ssize_t& x, ssize_t& y, ssize_t& z) const {
+            if (!active()) {
+              x = r % n[0]; y = (r / n[0]) % n[1]; z = r / (n[0]*n[1]);
+              return;
+            }
+            const ssize_t kz = r / (b[2]*n[0]*n[1]), lz = std::min(b[2], n[2] - kz*b[2]);
+            r -= kz*b[2]*n[0]*n[1];
+            const ssize_t ky = r / (b[1]*n[0]*lz), ly = std::min(b[1], n[1] - ky*b[1]);
+            r -= ky*b[1]*n[0]*lz;
+            const ssize_t kx = r / (b[0]*ly*lz), lx = std::min(b[0], n[0] - kx*b[0]);
+            r -= kx*b[0]*ly*lz;
+            x = kx*b[0] + r % lx; y = ky*b[1] + (r / lx) % ly; z = kz*b[2] + r / (lx*ly);
           }
 
-          FORCE_INLINE default_type clampdim (default_type r, size_t axis) const {
-            return (r < 0) ? 0 : (r > parent().size(axis)-1) ? parent().size(axis)-1 : r;
+          //! contiguous rows [r0, r0+nr) that hold recon planes lo to hi
+          void planes (ssize_t lo, ssize_t hi, size_t& r0, size_t& nr) const {
+            if (active()) {
+              lo -= lo % b[2];
+              hi = std::min(hi - hi % b[2] + b[2] - 1, n[2] - 1);
+            }
+            r0 = lo * n[0]*n[1];
+            nr = (hi - lo + 1) * n[0]*n[1];
+          }
+
+          //! copy the rows of X (nc columns, voxel-major) in planes z0 to z1-1 into B in this order
+          void to_bricks (const float* X, float* B, size_t nc, ssize_t z0, ssize_t z1) const {
+            size_t j = z0*n[0]*n[1];
+            for (ssize_t z = z0; z < z1; z++)
+              for (ssize_t y = 0; y < n[1]; y++)
+                for (ssize_t x = 0; x < n[0]; x++, j++)
+                  std::copy_n(X + j*nc, nc, B + row(x, y, z)*nc);
+          }
+
+          //! add the rows of B in this order in planes z0 to z1-1 to X (voxel-major)
+          void add_from_bricks (const float* B, float* X, size_t nc, ssize_t z0, ssize_t z1) const {
+            size_t j = z0*n[0]*n[1];
+            for (ssize_t z = z0; z < z1; z++)
+              for (ssize_t y = 0; y < n[1]; y++)
+                for (ssize_t x = 0; x < n[0]; x++, j++)
+                  Eigen::Map<Eigen::VectorXf> (X + j*nc, nc) += Eigen::Map<const Eigen::VectorXf> (B + row(x, y, z)*nc, nc);
           }
 
+        private:
+          ssize_t n[3], b[3];
       };
 
 
@@ -195,90 +679,298 @@ namespace MR
         MEMALIGN(ReconMapping);
         public:
           ReconMapping(const Header& recon, const Header& source, const QSpaceBasis& basis,
-                       const Eigen::MatrixXf& rigid, const SSP<float>& ssp)
+                       const Eigen::MatrixXf& rigid, const SSP<float>& ssp,
+                       const InterpKernel kernel = INTERP_CUBIC)
             : xhdr (recon), yhdr (source), ne (rigid.rows() / source.size(3)),
               outer_axes ({2,3}), slice_axes ({0,1}),
-              qbasis (basis), motion (rigid), ssp (ssp)
+              qbasis (basis), motion (rigid), ssp (ssp), kernel (kernel), reduction (REDUCE_LOCK),
+              projection (PROJECT_SHOT), grouping (false), bricks (recon),
+              readpool (spatial(recon), NAN), writepool (spatial(recon), 0.0f), dirtypool (spatial(recon), 0)
           {
             INFO("Multiband factor " + str(source.size(2)/ne) + " detected.");
           }
 
+          //! the same mapping, onto a different (e.g. coarser) recon grid
+          ReconMapping(const ReconMapping& other, const Header& recon)
+            : xhdr (recon), yhdr (other.yhdr), ne (other.ne),
+              outer_axes (other.outer_axes), slice_axes (other.slice_axes),
+              qbasis (other.qbasis), motion (other.motion), ssp (other.ssp),
+              kernel (other.kernel), reduction (other.reduction), projection (PROJECT_SHOT), grouping (false),
+              bricks (recon, other.bricks.size(0), other.bricks.size(1), other.bricks.size(2)),
+              readpool (spatial(recon), NAN), writepool (spatial(recon), 0.0f), dirtypool (spatial(recon), 0)
+          {
+            set_projection(other.projection);
+          }
+
           const Header& xheader() const { return xhdr; }
           const Header& yheader() const { return yhdr; }
 
+          const QSpaceBasis& basis() const { return qbasis; }
+          size_t excitations() const { return ne; }
+          InterpKernel interpolation() const { return kernel; }
+          MotionFootprint footprint() const { return MotionFootprint (xhdr, yhdr, motion, ssp, kernel); }
+
           size_t rows() const { return voxel_count(yhdr); }
           size_t cols() const { return voxel_count(xhdr); }
 
+          struct BufferScope { NOMEMALIGN
+            Adapter::BufferPool<float>::Scope read, write;
+            Adapter::BufferPool<uint8_t>::Scope dirty;
+          };
+
+          /**
+           * Keep the scratch buffers and locks of the projections for reuse in all projections
+           * until the returned scope closes, e.g. for all iterations of a solver. Otherwise,
+           * they are freed at the end of every projection.
+           */
+          BufferScope keep_buffers() const { return {readpool, writepool, dirtypool}; }
+
+          //! locks on the recon voxels, for the write back of concurrent shots
+          std::shared_ptr<Adapter::RowLocks> locks() const { return writepool.locks(); }
+
 
           template <typename ImageType1, typename ImageType2>
           void x2y(const ImageType1& X, ImageType2& Y) const
           {
-            // create adapters
-            auto qmap = Adapter::makecached<QSpaceMapping> (X, qbasis);
-            auto spatialmap = Adapter::make<MotionMapping> (qmap, yhdr, motion, ssp);
+            auto scope = keep_buffers();
+            dispatch_nc (X2Y<ImageType1, ImageType2> {*this, X, Y});
+          }
 
-            // define per-slice mapping
-            struct MapSliceX2Y {   MEMALIGN(MapSliceX2Y);
-              ImageType2 out;
-              decltype(spatialmap) pred;
-              size_t ne;
-              const vector<size_t>& axouter;
-              const vector<size_t>& axslice;
-              // define slice-wise operation
+          template <typename ImageType1, typename ImageType2>
+          void y2x(ImageType1& X, const ImageType2& Y) const
+          {
+            auto scope = keep_buffers();
+            dispatch_nc (Y2X<ImageType1, ImageType2> {*this, X, Y});
+          }
+
+          /**
+           * Normal-equations projection X += R^T W R X, with R the source prediction
+           * operator and W the slice and voxel weights. Each source slice is predicted,
+           * weighted and projected back in one pass, without storing the prediction.
+           * This pass always writes back under locks; with a lock-free reduction,
+           * ReconMatrixNormal uses x2y() and y2x() instead.
+           */
+          template <typename ImageType1, typename ImageType2>
+          void x2x(ImageType1& X, const ImageType2& Xin,
+                   const Eigen::MatrixXf& W, const Eigen::VectorXf& Wvox) const
+          {
+            auto scope = keep_buffers();
+            dispatch_nc (X2X<ImageType1, ImageType2> {*this, X, Xin, W, Wvox});
+          }
+
+          /**
+           * Precompute the sparse projection operator, i.e., the footprint of every source
+           * voxel as a fixed-width row of (recon voxel, weight) pairs, of which the first
+           * cache_len are in use (the composite SSP kernel is smaller for oblique slices
+           * than its upper bound footprint().size()). x2y, y2x and x2x then
+           * reduce to gather and scatter operations over this cache, without recomputing the
+           * transformations and interpolation weights in every call. This takes memory();
+           * the cache is only used for recon images with contiguous coefficients.
+           */
+          void precompute()
+          {
+            const size_t nsrc = voxel_count(yhdr);
+            const size_t width = footprint().size();
+            INFO("Precomputing projection operator (" + str(memory() >> 20) + " MB).");
+            cache_idx.resize(nsrc * width);
+            cache_wgt.resize(nsrc * width);
+            cache_len.assign(nsrc, 0);
+
+            struct CacheSlice {   MEMALIGN(CacheSlice);
+              MotionFootprint fp;
+              uint32_t* I;
+              float* W;
+              uint16_t* L;
+              const BrickLayout& bricks;
+              size_t ne, width;
+              ssize_t nx, ny, nz;
               void operator() (Iterator& pos) {
                 size_t z = pos.index(2);
                 size_t v = pos.index(3);
                 if (z < ne) {
-                  assign_pos_of (pos, axouter).to (out);
-                  pred.set_shotidx(v*ne+z%ne);
-                  for (size_t zz = z; zz < out.size(2); zz += ne) {
-                    out.index(2) = pred.index(2) = zz;
-                    for (auto i = Loop(axslice) (out, pred); i; ++i)
-                      out.value() += pred.value();
+                  fp.set_shotidx(v*ne+z%ne);
+                  for (ssize_t zz = z; zz < nz; zz += ne) {
+                    for (ssize_t y = 0; y < ny; y++) {
+                      const size_t j0 = ((v*nz + zz)*ny + y)*nx;
+                      fp.row(0, nx, y, zz, [&](ssize_t n, ssize_t i, ssize_t j, ssize_t k, float w) {
+                        size_t e = (j0+n)*width + L[j0+n]++;
+                        I[e] = bricks.row(i, j, k);
+                        W[e] = w;
+                      });
+                      // pad with zero weights on a valid voxel (the first in the row, or 0 if empty)
+                      for (size_t jj = j0; jj < j0+nx; jj++) {
+                        const uint32_t pad = L[jj] ? I[jj*width] : 0;
+                        for (size_t e = jj*width + L[jj]; e < (jj+1)*width; e++) {
+                          I[e] = pad;
+                          W[e] = 0.0f;
+                        }
+                      }
+                    }
                   }
                 }
               }
-            } func = {Y, spatialmap, ne, outer_axes, slice_axes};
+            } func = {footprint(), cache_idx.data(), cache_wgt.data(), cache_len.data(), bricks, ne, width,
+                      yhdr.size(0), yhdr.size(1), yhdr.size(2)};
 
-            // run across all slices
-            ThreadedLoop ("forward projection", Y, outer_axes, slice_axes)
+            ThreadedLoop ("precomputing projection operator", yhdr, outer_axes, slice_axes)
               .run_outer (func);
           }
 
-          template <typename ImageType1, typename ImageType2>
-          void y2x(ImageType1& X, const ImageType2& Y) const
+          //! memory required to precompute the projection operator, in bytes
+          size_t memory() const {
+            return voxel_count(yhdr) * (footprint().size() * (sizeof(uint32_t) + sizeof(float)) + sizeof(uint16_t));
+          }
+
+          bool cached() const { return cache_idx.size(); }
+
+          //! true if shots with the same motion are projected together
+          bool grouped() const { return grouping; }
+
+          enum Reduction { REDUCE_LOCK, REDUCE_SLAB, REDUCE_PULL };
+
+          /**
+           * Select the reduction strategy of the transpose projection. By default, the adjoint
+           * contributions of concurrent slices are scattered and written back under per-voxel
+           * locks. With slab reduction, every thread owns a z-slab of the recon volume and
+           * collects the contributions of all overlapping slices itself, without locks. Pull
+           * reduction does the same for small blocks of recon voxels, and only gathers from the
+           * source voxels whose footprint can reach the block.
+           */
+          void set_reduction(Reduction r) { reduction = r; }
+
+          //! true if the transpose projection uses slab or pull reduction
+          bool lockfree() const { return reduction != REDUCE_LOCK; }
+
+          enum Projection { PROJECT_SHOT, PROJECT_GROUP, PROJECT_VOLUME };
+
+          /**
+           * Select the projection of contiguous recon images. By default, the slices are
+           * projected shot by shot, with the q-space projection of every recon voxel evaluated
+           * lazily per shot. Grouped projection resamples the recon once for all shots with
+           * the same motion (see group_shots()), if its estimated cost is lower; lock-free
+           * reduction, if selected, still takes precedence in the transpose projection.
+           * Volume-wise projection contracts the recon planes in the footprint
+           * of each volume (or chunk of its slices) with the q-space projections of all its
+           * shots in one matrix product (see VolumeSlab). Its scratch slabs take slab_memory();
+           * if that exceeds the size of the recon image, the shot-wise projection is used
+           * instead. Call after set_bricks() and set_reduction().
+           */
+          void set_projection(Projection p)
           {
-            // create adapters
-            auto qmap = Adapter::makecached_add<QSpaceMapping> (X, qbasis);
-            auto spatialmap = Adapter::make<MotionMapping> (qmap, yhdr, motion, ssp);
+            projection = p;
+            grouping = (projection == PROJECT_GROUP) && group_shots();
+            if (projection == PROJECT_GROUP && !grouping) {
+              INFO("Grouped projection not faster than shot-wise; projecting shot by shot.");
+              projection = PROJECT_SHOT;
+            }
+            if (projection == PROJECT_VOLUME) {
+              const size_t mem = slab_memory();
+              if (mem > cols() * sizeof(float)) {
+                WARN("volume-wise projection exceeds memory bound (" + str(mem >> 20) + " MB); projecting shot by shot.");
+                projection = PROJECT_SHOT;
+              } else {
+                INFO("Projecting volume by volume (" + str(mem >> 20) + " MB in recon slabs).");
+              }
+            }
+          }
 
-            // define per-slice mapping
-            struct MapSliceY2X {   MEMALIGN(MapSliceY2X);
-              ImageType2 in;
-              decltype(spatialmap) pred;
-              size_t ne;
-              const vector<size_t>& axouter;
-              const vector<size_t>& axslice;
-              // define slice-wise operation
-              void operator() (Iterator& pos) {
-                size_t z = pos.index(2);
-                size_t v = pos.index(3);
-                if (z < ne) {
-                  assign_pos_of (pos, axouter).to (in);
-                  pred.set_shotidx(v*ne+z%ne);
-                  for (size_t zz = z; zz < in.size(2); zz += ne) {
-                    in.index(2) = pred.index(2) = zz;
-                    for (auto i = Loop(axslice) (in, pred); i; ++i)
-                      pred.adjoint_add (in.value());
+          //! memory of the recon slabs of the volume-wise projections on all threads, in bytes
+          size_t slab_memory() const
+          {
+            const vector<std::pair<ssize_t,ssize_t>> zrange = slice_zrange();
+            size_t nrmax = 0;
+            for (const auto& job : schedule_volumes()) {
+              size_t r0, nr;
+              slab_planes(job, zrange, r0, nr);
+              nrmax = std::max(nrmax, nr);
+            }
+            const size_t rxy = xhdr.size(0) * xhdr.size(1);
+            return Thread::number_of_threads() * (nrmax * ne + rxy * xhdr.size(3)) * sizeof(float);
+          }
+
+          /**
+           * Use bricks of bx x by x bz voxels for the recon coefficients in the projections of
+           * contiguous recon images (see BrickLayout). The images are converted to and from this
+           * layout on entry and exit of every projection, which keeps the solver vectors, the
+           * regularisers and the image I/O in voxel-major order. Call before precompute().
+           */
+          void set_bricks(ssize_t bx, ssize_t by, ssize_t bz) { bricks = BrickLayout (xhdr, bx, by, bz); }
+
+
+          typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXf;
+
+          //! row-major matrix with N columns, e.g. recon coefficients (or Eigen::Dynamic)
+          template <int N>
+          using RowMatrixNf = Eigen::Matrix<float, Eigen::Dynamic, N, Eigen::RowMajor>;
+
+          /**
+           * Projections of k recon images at once, e.g. for bootstrap replicates that share the
+           * same motion. X holds one row per recon voxel, with the coefficients of all k images
+           * side by side (nxyz x k*ncoefs), and Y one row per source voxel (nsrc x k). The
+           * transformations and interpolation weights are evaluated once for all k images, and
+           * the q-space contraction becomes a k x ncoefs product per voxel. All results are added
+           * to the output.
+           */
+          void x2y_multi(const RowMatrixXf& X, RowMatrixXf& Y) const
+          {
+            auto scope = keep_buffers();
+            project_multi(MULTI_FORWARD, &X, nullptr, nullptr, &Y, nullptr, nullptr);
+          }
+
+          void y2x_multi(RowMatrixXf& X, const RowMatrixXf& Y) const
+          {
+            auto scope = keep_buffers();
+            project_multi(MULTI_TRANSPOSE, nullptr, &X, &Y, nullptr, nullptr, nullptr);
+          }
+
+          //! X += R^T W_k R Xin, with slice weights W and separate voxel weights Wvox (nsrc x k) per image
+          void x2x_multi(RowMatrixXf& X, const RowMatrixXf& Xin, const Eigen::MatrixXf& W, const RowMatrixXf& Wvox) const
+          {
+            auto scope = keep_buffers();
+            project_multi(MULTI_NORMAL, &Xin, &X, nullptr, nullptr, &W, &Wvox);
+          }
+
+          /**
+           * Jobs for all shots with nonzero weight, with their cost estimated from the number of
+           * source voxels with nonzero weight. Shots that take more than a fraction of the total
+           * cost, e.g. whole volumes when ne = 1, are split into smaller groups of slices. Run
+           * them with run_shots().
+           */
+          vector<ShotJob> schedule(const Eigen::MatrixXf* W = nullptr, const Eigen::VectorXf* Wvox = nullptr) const
+          {
+            const size_t nxy = yhdr.size(0) * yhdr.size(1), nz = yhdr.size(2), nv = yhdr.size(3);
+            Eigen::MatrixXf cost (nz, nv);
+            for (size_t v = 0; v < nv; v++) {
+              for (size_t z = 0; z < nz; z++) {
+                if (W && (*W)(z,v) == 0.0f)
+                  cost(z,v) = 0.0f;
+                else if (Wvox)
+                  cost(z,v) = (Wvox->segment((v*nz + z)*nxy, nxy).array() != 0.0f).count();
+                else
+                  cost(z,v) = nxy;
+              }
+            }
+            const float maxcost = std::max(cost.sum() / (DEFAULT_SCHED_CHUNKS * Thread::number_of_threads()), float(nxy));
+            vector<ShotJob> jobs;
+            for (size_t v = 0; v < nv; v++) {
+              for (size_t e = 0; e < ne; e++) {
+                ShotJob job = {v, v*ne+e, e, e, 0.0f};
+                for (size_t z = e; z < nz; z += ne) {
+                  if (job.cost > 0.0f && job.cost + cost(z,v) > maxcost) {
+                    jobs.push_back(job);
+                    job.first = z;
+                    job.cost = 0.0f;
                   }
-                  pred.set_shotidx(0); // trigger delayed write back
+                  job.cost += cost(z,v);
+                  job.last = z + 1;
                 }
+                if (job.cost > 0.0f)
+                  jobs.push_back(job);
               }
-            } func = {Y, spatialmap, ne, outer_axes, slice_axes};
-
-            // run across all slices
-            ThreadedLoop ("transpose projection", Y, outer_axes, slice_axes)
-              .run_outer (func);
+            }
+            std::stable_sort(jobs.begin(), jobs.end(),
+                             [](const ShotJob& a, const ShotJob& b) { return a.cost > b.cost; });
+            return jobs;
           }
 
         private:
@@ -290,6 +982,1299 @@ namespace MR
           const QSpaceBasis qbasis;
           const Eigen::MatrixXf motion;
           const SSP<float> ssp;
+          const InterpKernel kernel;
+
+          vector<uint32_t> cache_idx;
+          vector<float> cache_wgt;
+          vector<uint16_t> cache_len;
+          Reduction reduction;
+          Projection projection;
+
+          vector<vector<size_t>> groups;    // shots with the same (quantised) motion
+          bool grouping;
+
+          BrickLayout bricks;
+
+          // per-thread scratch buffers, reused across projections
+          mutable Adapter::BufferPool<float> readpool, writepool;
+          mutable Adapter::BufferPool<uint8_t> dirtypool;    // recon voxels with pending write-back
+
+          static Header spatial(const Header& recon) {
+            Header H (recon);
+            H.ndim() = 3;
+            return H;
+          }
+
+
+          /* Thread-local state of the cached projection, analogous to the ReadCache and
+           * WriteCache adapters: scalar projections of the recon coefficients onto the
+           * current shot are evaluated lazily, and scalar adjoint contributions are
+           * accumulated and written back when the shot changes. The scalar buffers are
+           * taken from the buffer pools of the mapping. N is the no. coefficients, as in
+           * QSpace<N>::Mapping. */
+          template <int N>
+          class CachedShot
+          {
+            MEMALIGN(CachedShot<N>)
+            public:
+              CachedShot (const ReconMapping& map, const float* Xin, float* Xout, Adapter::RowLocks* lock)
+                : map (map), Xin (Xin), Xout (Xout), lock (lock),
+                  nc (map.xhdr.size(3)), width (map.footprint().size()),
+                  K ((map.kernel == INTERP_LINEAR) ? 2 : 4),
+                  projbuf (map.readpool.acquire()), accumbuf (map.writepool.acquire()), dirtybuf (map.dirtypool.acquire()),
+                  proj (projbuf.address()), accum (accumbuf.address()), dirty (dirtybuf.address())
+              { }
+
+              CachedShot (const CachedShot& other)
+                : CachedShot (other.map, other.Xin, other.Xout, other.lock) { }
+
+              ~CachedShot () {
+                flush();
+                map.readpool.release(projbuf);
+                map.writepool.release(accumbuf);
+                map.dirtypool.release(dirtybuf);
+              }
+
+              void set_shotidx (size_t idx) {
+                flush();
+                qr = map.qbasis.get_projection(idx);
+              }
+
+              // prediction of source voxel j
+              FORCE_INLINE float value (size_t j) {
+                const uint32_t* I = map.cache_idx.data() + j*width;
+                const float* W = map.cache_wgt.data() + j*width;
+                prefetch(I + width, proj);
+                float res = 0.0f;
+                for (size_t e = 0; e < map.cache_len[j]; e++) {
+                  float& p = proj[I[e]];
+                  if (!std::isfinite(p)) {
+                    p = qr.dot(Eigen::Map<const vector_type> (Xin + size_t(I[e])*nc, nc));
+                    loaded.push_back(I[e]);
+                  }
+                  res += W[e] * p;
+                }
+                return res;
+              }
+
+              // adjoint of the prediction of source voxel j
+              FORCE_INLINE void adjoint_add (size_t j, float val) {
+                const uint32_t* I = map.cache_idx.data() + j*width;
+                const float* W = map.cache_wgt.data() + j*width;
+                prefetch(I + width, accum);
+                for (size_t e = 0; e < map.cache_len[j]; e++) {
+                  if (!dirty[I[e]]) {
+                    dirty[I[e]] = 1;
+                    touched.push_back(I[e]);
+                  }
+                  accum[I[e]] += W[e] * val;
+                }
+              }
+
+              void flush () {
+                for (auto i : loaded)
+                  proj[i] = NAN;
+                loaded.clear();
+                for (auto i : touched) {
+                  dirty[i] = 0;
+                  if (accum[i] == 0.0f) continue;
+                  Adapter::RowLock guard (*lock, i);
+                  Eigen::Map<vector_type> (Xout + size_t(i)*nc, nc) += accum[i] * qr;
+                  accum[i] = 0.0f;
+                }
+                touched.clear();
+              }
+
+            private:
+              const ReconMapping& map;
+              const float* Xin;
+              float* Xout;
+              Adapter::RowLocks* lock;
+              const size_t nc, width, K;
+              using vector_type = Eigen::Matrix<float, N, 1, Eigen::DontAlign>;
+              vector_type qr;
+              Image<float> projbuf, accumbuf;
+              Image<uint8_t> dirtybuf;
+              float* proj;
+              float* accum;
+              uint8_t* dirty;
+              vector<uint32_t> loaded, touched;
+
+              // prefetch the K x K rows in the first SSP tap of the next source voxel, which
+              // is shifted by about one recon voxel and mostly hits the same cache lines
+              FORCE_INLINE void prefetch (const uint32_t* I, const float* buf) const {
+                if (I + width > map.cache_idx.data() + map.cache_idx.size()) return;
+                for (size_t e = 0; e < std::min(width, K*K*K); e += K)
+                  __builtin_prefetch (buf + I[e]);
+              }
+          };
+
+          template <typename ImageType>
+          bool contiguous(const ImageType& X) const {
+            const ssize_t nc = xhdr.size(3);
+            const Stride::List s = Stride::get_actual(X);
+            return s[3] == 1 && s[0] == nc && s[1] == nc*xhdr.size(0)
+                && s[2] == nc*xhdr.size(0)*xhdr.size(1);
+          }
+
+          template <typename ImageType>
+          float* address(const ImageType& X) const {
+            ImageType X0 (X);
+            for (size_t n = 0; n < 4; n++)
+              X0.index(n) = 0;
+            return X0.address();
+          }
+
+          /* The projections are specialised for the no. coefficients N of common
+           * configurations (or Eigen::Dynamic), which dispatch_nc() selects once per call,
+           * and x2y_nc<N>() etc. then select the projection path. */
+          template <class Op>
+          void dispatch_nc(Op&& op) const
+          {
+            Specialise<Eigen::Dynamic, 22, 28, 45>::run (xhdr.size(3), std::forward<Op>(op));
+          }
+
+          template <typename ImageType1, typename ImageType2>
+          struct X2Y {   NOMEMALIGN
+            const ReconMapping& map;
+            const ImageType1& X;
+            ImageType2& Y;
+            template <int N> void run () { map.x2y_nc<N> (X, Y); }
+          };
+
+          template <typename ImageType1, typename ImageType2>
+          struct Y2X {   NOMEMALIGN
+            const ReconMapping& map;
+            ImageType1& X;
+            const ImageType2& Y;
+            template <int N> void run () { map.y2x_nc<N> (X, Y); }
+          };
+
+          template <typename ImageType1, typename ImageType2>
+          struct X2X {   NOMEMALIGN
+            const ReconMapping& map;
+            ImageType1& X;
+            const ImageType2& Xin;
+            const Eigen::MatrixXf& W;
+            const Eigen::VectorXf& Wvox;
+            template <int N> void run () { map.x2x_nc<N> (X, Xin, W, Wvox); }
+          };
+
+          template <int N, typename ImageType1, typename ImageType2>
+          void x2y_nc(const ImageType1& X, ImageType2& Y) const
+          {
+            if (grouping && contiguous(X))
+              return bricked(address(X), [&](const float* B) { x2y_grouped<N>(B, Y); });
+            if (projection == PROJECT_VOLUME && contiguous(X))
+              return bricked(address(X), [&](const float* B) { x2y_volume<N>(B, Y); });
+            if (cached() && contiguous(X))
+              return bricked(address(X), [&](const float* B) { x2y_cached<N>(B, Y); });
+            x2y_adapted<N> (X, Y);
+          }
+
+          template <int N, typename ImageType1, typename ImageType2>
+          void y2x_nc(ImageType1& X, const ImageType2& Y) const
+          {
+            if (reduction != REDUCE_LOCK && contiguous(X))
+              return bricked_add(address(X), [&](float* B) { y2x_blocked<N>(B, Y); });
+            if (grouping && contiguous(X))
+              return bricked_add(address(X), [&](float* B) { y2x_grouped<N>(B, Y); });
+            if (projection == PROJECT_VOLUME && contiguous(X))
+              return bricked_add(address(X), [&](float* B) { y2x_volume<N>(B, Y); });
+            if (cached() && contiguous(X))
+              return bricked_add(address(X), [&](float* B) { y2x_cached<N>(B, Y); });
+            y2x_adapted<N> (X, Y);
+          }
+
+          template <int N, typename ImageType1, typename ImageType2>
+          void x2x_nc(ImageType1& X, const ImageType2& Xin,
+                      const Eigen::MatrixXf& W, const Eigen::VectorXf& Wvox) const
+          {
+            if (grouping && contiguous(X) && contiguous(Xin))
+              return bricked(address(Xin), [&](const float* B) {
+                bricked_add(address(X), [&](float* A) { x2x_grouped<N>(A, B, W, Wvox); });
+              });
+            if (cached() && contiguous(X) && contiguous(Xin))
+              return bricked(address(Xin), [&](const float* B) {
+                bricked_add(address(X), [&](float* A) { x2x_cached<N>(A, B, W, Wvox); });
+              });
+            x2x_adapted<N> (X, Xin, W, Wvox);
+          }
+
+          /* Projections through the adapters, for recon images of any layout. The footprint
+           * is specialised for the no. SSP taps 2H+1 (or H = -1), which the adapted<N>()
+           * overloads select once per projection. */
+          template <int N, typename ImageType1, typename ImageType2>
+          struct X2YAdapted {   NOMEMALIGN
+            const ReconMapping& map;
+            const ImageType1& X;
+            ImageType2& Y;
+            template <int H> void run () { map.x2y_adapted<N,H> (X, Y); }
+          };
+
+          template <int N, typename ImageType1, typename ImageType2>
+          struct Y2XAdapted {   NOMEMALIGN
+            const ReconMapping& map;
+            ImageType1& X;
+            const ImageType2& Y;
+            template <int H> void run () { map.y2x_adapted<N,H> (X, Y); }
+          };
+
+          template <int N, typename ImageType1, typename ImageType2>
+          struct X2XAdapted {   NOMEMALIGN
+            const ReconMapping& map;
+            ImageType1& X;
+            const ImageType2& Xin;
+            const Eigen::MatrixXf& W;
+            const Eigen::VectorXf& Wvox;
+            template <int H> void run () { map.x2x_adapted<N,H> (X, Xin, W, Wvox); }
+          };
+
+          template <int N, typename ImageType1, typename ImageType2>
+          void x2y_adapted(const ImageType1& X, ImageType2& Y) const
+          {
+            SpecialiseTaps::run (ssp.size(), X2YAdapted<N, ImageType1, ImageType2> {*this, X, Y});
+          }
+
+          template <int N, typename ImageType1, typename ImageType2>
+          void y2x_adapted(ImageType1& X, const ImageType2& Y) const
+          {
+            SpecialiseTaps::run (ssp.size(), Y2XAdapted<N, ImageType1, ImageType2> {*this, X, Y});
+          }
+
+          template <int N, typename ImageType1, typename ImageType2>
+          void x2x_adapted(ImageType1& X, const ImageType2& Xin,
+                           const Eigen::MatrixXf& W, const Eigen::VectorXf& Wvox) const
+          {
+            SpecialiseTaps::run (ssp.size(), X2XAdapted<N, ImageType1, ImageType2> {*this, X, Xin, W, Wvox});
+          }
+
+          template <int N, int H, typename ImageType1, typename ImageType2>
+          void x2y_adapted(const ImageType1& X, ImageType2& Y) const
+          {
+            // create adapters
+            auto qmap = Adapter::makepooled<QSpace<N>::template Mapping> (readpool, X, qbasis);
+            auto spatialmap = Adapter::make<MotionTaps<H>::template Mapping> (qmap, yhdr, motion, ssp, kernel);
+
+            // define per-slice mapping, traversing the slices in tiles
+            const vector<size_t> tiles = tile_sizes();
+            struct MapSliceX2Y {   MEMALIGN(MapSliceX2Y);
+              const ReconMapping& map;
+              ImageType2 out;
+              decltype(spatialmap) pred;
+              const vector<size_t>& tiles;
+              // define shot-wise operation
+              void operator() (const ShotJob& job) {
+                out.index(3) = job.v;
+                pred.set_shotidx(job.shot);
+                for (size_t zz = job.first; zz < job.last; zz += map.ne) {
+                  out.index(2) = pred.index(2) = zz;
+                  map.slice_tiles(tiles[job.shot], [&](ssize_t y, ssize_t x0, ssize_t x1) {
+                    out.index(1) = pred.index(1) = y;
+                    for (ssize_t x = x0; x < x1; x++) {
+                      out.index(0) = pred.index(0) = x;
+                      out.value() += pred.value();
+                    }
+                  });
+                }
+              }
+            } func = {*this, Y, spatialmap, tiles};
+
+            // run across all shots
+            run_shots ("forward projection", schedule(), func);
+          }
+
+          template <int N, int H, typename ImageType1, typename ImageType2>
+          void y2x_adapted(ImageType1& X, const ImageType2& Y) const
+          {
+            // create adapters
+            auto qmap = Adapter::makepooled_add<QSpace<N>::template Mapping> (writepool, X, qbasis);
+            auto spatialmap = Adapter::make<MotionTaps<H>::template Mapping> (qmap, yhdr, motion, ssp, kernel);
+
+            // define per-slice mapping, traversing the slices in tiles
+            const vector<size_t> tiles = tile_sizes();
+            struct MapSliceY2X {   MEMALIGN(MapSliceY2X);
+              const ReconMapping& map;
+              ImageType2 in;
+              decltype(spatialmap) pred;
+              const vector<size_t>& tiles;
+              // define shot-wise operation
+              void operator() (const ShotJob& job) {
+                in.index(3) = job.v;
+                pred.set_shotidx(job.shot);
+                for (size_t zz = job.first; zz < job.last; zz += map.ne) {
+                  in.index(2) = pred.index(2) = zz;
+                  map.slice_tiles(tiles[job.shot], [&](ssize_t y, ssize_t x0, ssize_t x1) {
+                    in.index(1) = pred.index(1) = y;
+                    for (ssize_t x = x0; x < x1; x++) {
+                      in.index(0) = pred.index(0) = x;
+                      pred.adjoint_add (in.value());
+                    }
+                  });
+                }
+                pred.set_shotidx(0); // trigger delayed write back
+              }
+            } func = {*this, Y, spatialmap, tiles};
+
+            // run across all shots
+            run_shots ("transpose projection", schedule(), func);
+          }
+
+          template <int N, int H, typename ImageType1, typename ImageType2>
+          void x2x_adapted(ImageType1& X, const ImageType2& Xin,
+                           const Eigen::MatrixXf& W, const Eigen::VectorXf& Wvox) const
+          {
+            // create adapters
+            auto qmapin = Adapter::makepooled<QSpace<N>::template Mapping> (readpool, Xin, qbasis);
+            auto spatialmapin = Adapter::make<MotionTaps<H>::template Mapping> (qmapin, yhdr, motion, ssp, kernel);
+            auto qmapout = Adapter::makepooled_add<QSpace<N>::template Mapping> (writepool, X, qbasis);
+            auto spatialmapout = Adapter::make<MotionTaps<H>::template Mapping> (qmapout, yhdr, motion, ssp, kernel);
+
+            // define per-slice mapping, traversing the slices in tiles
+            const vector<size_t> tiles = tile_sizes();
+            struct MapSliceX2X {   MEMALIGN(MapSliceX2X);
+              const ReconMapping& map;
+              decltype(spatialmapin) pred;
+              decltype(spatialmapout) back;
+              const Eigen::MatrixXf& W;
+              const Eigen::VectorXf& Wvox;
+              const vector<size_t>& tiles;
+              size_t nx, ny, nz;
+              // define shot-wise operation
+              void operator() (const ShotJob& job) {
+                const size_t v = job.v;
+                pred.set_shotidx(job.shot);
+                back.set_shotidx(job.shot);
+                for (size_t zz = job.first; zz < job.last; zz += map.ne) {
+                  if (W(zz,v) == 0.0f) continue;
+                  pred.index(2) = back.index(2) = zz;
+                  const size_t j0 = (v*nz + zz)*nx*ny;
+                  map.slice_tiles(tiles[job.shot], [&](ssize_t y, ssize_t x0, ssize_t x1) {
+                    pred.index(1) = back.index(1) = y;
+                    for (ssize_t x = x0; x < x1; x++) {
+                      float w = W(zz,v) * Wvox[j0 + y*nx + x];
+                      if (w == 0.0f) continue;
+                      pred.index(0) = back.index(0) = x;
+                      back.adjoint_add (w * pred.value());
+                    }
+                  });
+                }
+                back.set_shotidx(0); // trigger delayed write back
+              }
+            } func = {*this, spatialmapin, spatialmapout, W, Wvox, tiles,
+                      size_t(yhdr.size(0)), size_t(yhdr.size(1)), size_t(yhdr.size(2))};
+
+            // run across all shots
+            run_shots ("normal projection", schedule(&W, &Wvox), func);
+          }
+
+          //! call f(B) with the contiguous recon coefficients X in the layout of the projections
+          template <class Functor>
+          void bricked(const float* X, Functor&& f) const {
+            if (!bricks.active()) return f(X);
+            Eigen::VectorXf B (voxel_count(xhdr));
+            brick_planes([&](ssize_t z) { bricks.to_bricks(X, B.data(), xhdr.size(3), z, z+1); });
+            f(B.data());
+          }
+
+          //! call f(B) on a zeroed buffer B in the layout of the projections, and add B to X
+          template <class Functor>
+          void bricked_add(float* X, Functor&& f) const {
+            if (!bricks.active()) return f(X);
+            Eigen::VectorXf B = Eigen::VectorXf::Zero(voxel_count(xhdr));
+            f(B.data());
+            brick_planes([&](ssize_t z) { bricks.add_from_bricks(B.data(), X, xhdr.size(3), z, z+1); });
+          }
+
+          //! call f(z) for every recon plane z, on all threads (the planes of the layouts are disjoint)
+          template <class Functor>
+          void brick_planes(Functor&& f) const {
+            ThreadedLoop (xhdr, vector<size_t>({2}), vector<size_t>({0, 1}))
+              .run_outer ([&](Iterator& pos) { f(pos.index(2)); });
+          }
+
+          //! range of recon planes [first, last] in the footprint of every source slice (v, z)
+          vector<std::pair<ssize_t,ssize_t>> slice_zrange() const
+          {
+            const ssize_t nx = yhdr.size(0), ny = yhdr.size(1), nz = yhdr.size(2), nv = yhdr.size(3);
+            const default_type rmax = xhdr.size(2) - 1;
+            vector<std::pair<ssize_t,ssize_t>> range (nv*nz);
+            MotionFootprint fp = footprint();
+            for (ssize_t v = 0; v < nv; v++) {
+              for (ssize_t z = 0; z < nz; z++) {
+                fp.set_shotidx(v*ne + z%ne);
+                default_type pmin = rmax, pmax = 0;
+                // the footprint is convex: check the corners of the slice and its SSP
+                for (size_t c = 0; c < 8; c++) {
+                  Eigen::Vector3d ps ((c & 1) ? nx-1 : 0, (c & 2) ? ny-1 : 0,
+                                      z + ((c & 4) ? fp.ssp_size() : -fp.ssp_size()));
+                  default_type p = (fp.transform() * ps)[2];
+                  p = (p < 0) ? 0 : (p > rmax) ? rmax : p;
+                  pmin = std::min(pmin, p);
+                  pmax = std::max(pmax, p);
+                }
+                range[v*nz+z] = { std::max(ssize_t(std::floor(pmin)) - 1, ssize_t(0)),
+                                  std::min(ssize_t(std::floor(pmax)) + 2, ssize_t(rmax)) };
+              }
+            }
+            return range;
+          }
+
+          /* Lock-free transpose projection, gathering into blocks of recon voxels. Every block is
+           * owned by the thread that processes it, and visits the source slices whose footprint
+           * overlaps it. Within a slice, only the source voxels that map into the block (grown
+           * by the interpolation support) are visited; blocks on the edge of the recon volume
+           * also receive the clamped contributions from outside, and are grown on that side
+           * up to the footprint of the source volume.
+           * Slab reduction uses blocks that span the whole x-y plane. */
+          template <int N, typename ImageType2>
+          void y2x_blocked(float* X, const ImageType2& Y) const
+          {
+            ssize_t bsize[3];
+            if (reduction == REDUCE_SLAB) {
+              const ssize_t nslabs = 2 * Thread::number_of_threads();
+              bsize[0] = xhdr.size(0);
+              bsize[1] = xhdr.size(1);
+              bsize[2] = std::max((xhdr.size(2) + nslabs - 1) / nslabs, ssize_t(1));
+            } else {
+              bsize[0] = bsize[1] = bsize[2] = DEFAULT_PULL_BLOCK;
+            }
+            const vector<std::pair<ssize_t,ssize_t>> zrange = slice_zrange();
+
+            struct BlockY2X {   MEMALIGN(BlockY2X);
+              const ReconMapping& map;
+              ImageType2 in;
+              MotionFootprint fp;
+              float* X;
+              const vector<std::pair<ssize_t,ssize_t>>& zrange;
+              const ssize_t* bsize;
+              ssize_t lo[3], hi[3];
+              vector<float> accum;
+              vector<uint8_t> dirty;
+              vector<uint32_t> touched;
+              // process the row of blocks starting at recon voxel (0, y, z)
+              void operator() (const BlockJob& job) {
+                for (ssize_t x = 0; x < map.xhdr.size(0); x += bsize[0]) {
+                  const ssize_t start[3] = { x, job.y, job.z };
+                  for (size_t k = 0; k < 3; k++) {
+                    lo[k] = start[k];
+                    hi[k] = std::min(start[k] + bsize[k], ssize_t(map.xhdr.size(k)));
+                  }
+                  block();
+                }
+              }
+              void block () {
+                const ssize_t nx = in.size(0), ny = in.size(1), nz = in.size(2), ne = map.ne;
+                const size_t width = fp.size();
+                accum.assign((hi[0]-lo[0])*(hi[1]-lo[1])*(hi[2]-lo[2]), 0.0f);
+                dirty.assign(accum.size(), 0);
+                for (ssize_t v = 0; v < in.size(3); v++) {
+                  in.index(3) = v;
+                  for (ssize_t s = 0; s < ne; s++) {
+                    bool overlap = false;
+                    for (ssize_t z = s; z < nz; z += ne)
+                      overlap |= zrange[v*nz+z].first < hi[2] && zrange[v*nz+z].second >= lo[2];
+                    if (!overlap) continue;
+                    fp.set_shotidx(v*ne+s);
+                    ssize_t sx0 = 0, sx1 = nx, sy0 = 0, sy1 = ny;
+                    source_region(sx0, sx1, sy0, sy1);
+                    for (ssize_t z = s; z < nz; z += ne) {
+                      if (zrange[v*nz+z].first >= hi[2] || zrange[v*nz+z].second < lo[2]) continue;
+                      in.index(2) = z;
+                      for (in.index(1) = sy0; in.index(1) < sy1; ++in.index(1)) {
+                        size_t j = ((v*nz + z)*ny + in.index(1))*nx + sx0;
+                        for (in.index(0) = sx0; in.index(0) < sx1; ++in.index(0), ++j) {
+                          float val = in.value();
+                          if (val == 0.0f) continue;
+                          if (map.cached()) {
+                            ssize_t a, b, c;
+                            for (size_t e = j*width; e < j*width + map.cache_len[j]; e++) {
+                              map.bricks.voxel(map.cache_idx[e], a, b, c);
+                              add(a, b, c, map.cache_wgt[e] * val);
+                            }
+                          } else {
+                            fp(in.index(0), in.index(1), z, [&](ssize_t a, ssize_t b, ssize_t c, float w) {
+                              add(a, b, c, w * val);
+                            });
+                          }
+                        }
+                      }
+                    }
+                    writeback(v*ne+s);
+                  }
+                }
+              }
+              // bounding box (in source x-y) of the source voxels that can reach the block
+              void source_region (ssize_t& x0, ssize_t& x1, ssize_t& y0, ssize_t& y1) const {
+                // the block, grown by the cubic support
+                default_type blo[3], bhi[3];
+                for (size_t k = 0; k < 3; k++) {
+                  blo[k] = lo[k] - 2;
+                  bhi[k] = hi[k] + 1;
+                }
+                // edge blocks also take the contributions clamped from outside the recon volume:
+                // grow them outwards up to the footprint of the source volume
+                bool edge = false;
+                for (size_t k = 0; k < 3; k++)
+                  edge |= lo[k] == 0 || hi[k] == map.xhdr.size(k);
+                if (edge) {
+                  const ssize_t h = fp.ssp_size();
+                  for (size_t c = 0; c < 8; c++) {
+                    Eigen::Vector3d ps ((c & 1) ? x1 : x0-1, (c & 2) ? y1 : y0-1,
+                                        (c & 4) ? map.yhdr.size(2)+h : -h-1);
+                    Eigen::Vector3d pr = fp.transform() * ps;
+                    for (size_t k = 0; k < 3; k++) {
+                      if (lo[k] == 0) blo[k] = std::min(blo[k], pr[k] - 2);
+                      if (hi[k] == map.xhdr.size(k)) bhi[k] = std::max(bhi[k], pr[k] + 1);
+                    }
+                  }
+                }
+                const transform_type Tr2s = fp.transform().inverse();
+                default_type pmin[2] = { default_type(x1), default_type(y1) }, pmax[2] = { -1, -1 };
+                for (size_t c = 0; c < 8; c++) {
+                  Eigen::Vector3d pr ((c & 1) ? bhi[0] : blo[0], (c & 2) ? bhi[1] : blo[1],
+                                      (c & 4) ? bhi[2] : blo[2]);
+                  Eigen::Vector3d ps = Tr2s * pr;
+                  for (size_t k = 0; k < 2; k++) {
+                    pmin[k] = std::min(pmin[k], ps[k]);
+                    pmax[k] = std::max(pmax[k], ps[k]);
+                  }
+                }
+                x0 = std::max(ssize_t(std::floor(pmin[0])), x0);
+                x1 = std::min(ssize_t(std::ceil(pmax[0])) + 1, x1);
+                y0 = std::max(ssize_t(std::floor(pmin[1])), y0);
+                y1 = std::min(ssize_t(std::ceil(pmax[1])) + 1, y1);
+              }
+              FORCE_INLINE void add (ssize_t x, ssize_t y, ssize_t z, float val) {
+                if (x < lo[0] || x >= hi[0] || y < lo[1] || y >= hi[1] || z < lo[2] || z >= hi[2]) return;
+                const uint32_t i = ((z-lo[2])*(hi[1]-lo[1]) + (y-lo[1]))*(hi[0]-lo[0]) + (x-lo[0]);
+                if (!dirty[i]) {
+                  dirty[i] = 1;
+                  touched.push_back(i);
+                }
+                accum[i] += val;
+              }
+              // write back the contributions of one shot to the owned block
+              void writeback (size_t idx) {
+                using vector_type = Eigen::Matrix<float, N, 1, Eigen::DontAlign>;
+                const vector_type qr = map.qbasis.get_projection(idx);
+                const ssize_t nc = map.xhdr.size(3), bx = hi[0]-lo[0], by = hi[1]-lo[1];
+                for (auto i : touched) {
+                  dirty[i] = 0;
+                  if (accum[i] == 0.0f) continue;
+                  const ssize_t x = lo[0] + i % bx, y = lo[1] + (i / bx) % by, z = lo[2] + i / (bx*by);
+                  const size_t r = map.bricks.row(x, y, z);
+                  Eigen::Map<vector_type> (X + r*nc, nc) += accum[i] * qr;
+                  accum[i] = 0.0f;
+                }
+                touched.clear();
+              }
+            } func = {*this, Y, footprint(), X, zrange, bsize, {0, 0, 0}, {0, 0, 0}, {}, {}, {}};
+
+            run_shots ("transpose projection", schedule_blocks(bsize, zrange), func);
+          }
+
+          /* Jobs for all rows of recon blocks of size bsize, with their cost estimated from the
+           * no. source slices that overlap them, in the ranges zrange of slice_zrange(). */
+          vector<BlockJob> schedule_blocks(const ssize_t* bsize, const vector<std::pair<ssize_t,ssize_t>>& zrange) const
+          {
+            vector<BlockJob> jobs;
+            for (ssize_t z = 0; z < xhdr.size(2); z += bsize[2]) {
+              const ssize_t zend = std::min(z + bsize[2], ssize_t(xhdr.size(2)));
+              size_t nslices = 0;
+              for (const auto& r : zrange)
+                nslices += r.first < zend && r.second >= z;
+              if (!nslices) continue;
+              for (ssize_t y = 0; y < xhdr.size(1); y += bsize[1])
+                jobs.push_back({y, z, float(nslices * std::min(bsize[1], xhdr.size(1) - y))});
+            }
+            std::stable_sort(jobs.begin(), jobs.end(),
+                             [](const BlockJob& a, const BlockJob& b) { return a.cost > b.cost; });
+            return jobs;
+          }
+
+          template <int N, typename ImageType2>
+          void x2y_cached(const float* X, ImageType2& Y) const
+          {
+            struct CachedX2Y {   MEMALIGN(CachedX2Y);
+              ImageType2 out;
+              CachedShot<N> pred;
+              size_t ne;
+              const vector<size_t>& axslice;
+              void operator() (const ShotJob& job) {
+                out.index(3) = job.v;
+                pred.set_shotidx(job.shot);
+                for (size_t zz = job.first; zz < job.last; zz += ne) {
+                  out.index(2) = zz;
+                  size_t j = (job.v*out.size(2) + zz)*out.size(0)*out.size(1);
+                  for (auto i = Loop(axslice) (out); i; ++i, ++j)
+                    out.value() += pred.value(j);
+                }
+              }
+            } func = {Y, CachedShot<N> (*this, X, nullptr, nullptr), ne, slice_axes};
+
+            run_shots ("forward projection", schedule(), func);
+          }
+
+          template <int N, typename ImageType2>
+          void y2x_cached(float* X, const ImageType2& Y) const
+          {
+            const std::shared_ptr<Adapter::RowLocks> lock = writepool.locks();
+
+            struct CachedY2X {   MEMALIGN(CachedY2X);
+              ImageType2 in;
+              CachedShot<N> pred;
+              size_t ne;
+              const vector<size_t>& axslice;
+              void operator() (const ShotJob& job) {
+                in.index(3) = job.v;
+                pred.set_shotidx(job.shot);
+                for (size_t zz = job.first; zz < job.last; zz += ne) {
+                  in.index(2) = zz;
+                  size_t j = (job.v*in.size(2) + zz)*in.size(0)*in.size(1);
+                  for (auto i = Loop(axslice) (in); i; ++i, ++j)
+                    pred.adjoint_add (j, in.value());
+                }
+                pred.flush();
+              }
+            } func = {Y, CachedShot<N> (*this, nullptr, X, lock.get()), ne, slice_axes};
+
+            run_shots ("transpose projection", schedule(), func);
+          }
+
+          template <int N>
+          void x2x_cached(float* X, const float* Xin, const Eigen::MatrixXf& W, const Eigen::VectorXf& Wvox) const
+          {
+            const std::shared_ptr<Adapter::RowLocks> lock = writepool.locks();
+
+            struct CachedX2X {   MEMALIGN(CachedX2X);
+              CachedShot<N> pred;
+              const Eigen::MatrixXf& W;
+              const Eigen::VectorXf& Wvox;
+              size_t ne, nxy, nz;
+              void operator() (const ShotJob& job) {
+                const size_t v = job.v;
+                pred.set_shotidx(job.shot);
+                for (size_t zz = job.first; zz < job.last; zz += ne) {
+                  if (W(zz,v) == 0.0f) continue;
+                  size_t j = (v*nz + zz)*nxy;
+                  for (size_t i = 0; i < nxy; i++, j++) {
+                    float w = W(zz,v) * Wvox[j];
+                    if (w != 0.0f) pred.adjoint_add (j, w * pred.value(j));
+                  }
+                }
+                pred.flush();
+              }
+            } func = {CachedShot<N> (*this, Xin, X, lock.get()), W, Wvox, ne,
+                      size_t(yhdr.size(0)*yhdr.size(1)), size_t(yhdr.size(2))};
+
+            run_shots ("normal projection", schedule(&W, &Wvox), func);
+          }
+
+
+          /* Call f(j, r, w) for the footprint (recon voxel r, weight w) of every source voxel j
+           * in slice (v, z), from the precomputed operator if available, in the tiled order of
+           * slice_tiles(). fp must be set to the shot that acquired the slice. */
+          template <class Functor>
+          void slice_footprint(MotionFootprint& fp, size_t v, size_t z, Functor&& f) const
+          {
+            const size_t nx = yhdr.size(0), ny = yhdr.size(1);
+            const size_t j0 = (v*yhdr.size(2) + z)*nx*ny;
+            const size_t width = cached() ? cache_idx.size() / rows() : 0;
+            slice_tiles(tile_size(fp.transform()), [&](ssize_t y, ssize_t x0, ssize_t x1) {
+              if (cached()) {
+                for (size_t j = y*nx + x0; j < y*nx + x1; j++)
+                  for (size_t e = (j0+j)*width; e < (j0+j)*width + cache_len[j0+j]; e++)
+                    f(j, cache_idx[e], cache_wgt[e]);
+              } else {
+                fp.row(x0, x1 - x0, y, z, [&](ssize_t n, ssize_t a, ssize_t b, ssize_t c, float w) {
+                  f(y*nx + x0 + n, bricks.row(a, b, c), w);
+                });
+              }
+            });
+          }
+
+          /* Width of the square tiles in which the slices of a shot with vox-to-vox transform T
+           * are traversed. A source row that stays within one recon row (up to a voxel) is
+           * traversed in raster order. Under larger rotations, consecutive source rows sweep
+           * diagonally across the recon volume, and tiles of DEFAULT_SLICE_TILE voxels keep the
+           * recon voxels in reach of consecutive source voxels local. */
+          size_t tile_size(const transform_type& T) const
+          {
+            const default_type drift = yhdr.size(0) * T.linear().col(0).tail<2>().norm();
+            return (drift > 1.0) ? DEFAULT_SLICE_TILE : yhdr.size(0);
+          }
+
+          //! tile width of every shot
+          vector<size_t> tile_sizes() const
+          {
+            MotionFootprint fp = footprint();
+            vector<size_t> tiles (motion.rows());
+            for (size_t s = 0; s < tiles.size(); s++) {
+              fp.set_shotidx(s);
+              tiles[s] = tile_size(fp.transform());
+            }
+            return tiles;
+          }
+
+          //! call f(y, x0, x1) for the row segments of a source slice, tile by tile
+          template <class Functor>
+          void slice_tiles(size_t tile, Functor&& f) const
+          {
+            const ssize_t nx = yhdr.size(0), ny = yhdr.size(1);
+            const ssize_t tx = tile, ty = (tx < nx) ? tx : ny;
+            for (ssize_t y0 = 0; y0 < ny; y0 += ty)
+              for (ssize_t x0 = 0; x0 < nx; x0 += tx)
+                for (ssize_t y = y0; y < std::min(y0 + ty, ny); y++)
+                  f(y, x0, std::min(x0 + tx, nx));
+          }
+
+          /* Jobs for consecutive slices of every volume, covering all its shots. Volumes are
+           * split into chunks of slices as in schedule(). */
+          vector<ShotJob> schedule_volumes() const
+          {
+            const size_t nxy = yhdr.size(0) * yhdr.size(1), nz = yhdr.size(2), nv = yhdr.size(3);
+            const float maxcost = std::max(float(nxy*nz*nv) / (DEFAULT_SCHED_CHUNKS * Thread::number_of_threads()), float(nxy*ne));
+            vector<ShotJob> jobs;
+            for (size_t v = 0; v < nv; v++) {
+              ShotJob job = {v, v*ne, 0, 0, 0.0f};
+              for (size_t z = 0; z < nz; z++) {
+                if (job.cost > 0.0f && job.cost + nxy > maxcost) {
+                  jobs.push_back(job);
+                  job.first = z;
+                  job.cost = 0.0f;
+                }
+                job.cost += nxy;
+                job.last = z + 1;
+              }
+              jobs.push_back(job);
+            }
+            std::stable_sort(jobs.begin(), jobs.end(),
+                             [](const ShotJob& a, const ShotJob& b) { return a.cost > b.cost; });
+            return jobs;
+          }
+
+          //! contiguous recon rows [r0, r0+nr) in the footprint of the slices of job
+          void slab_planes(const ShotJob& job, const vector<std::pair<ssize_t,ssize_t>>& zrange,
+                           size_t& r0, size_t& nr) const
+          {
+            const size_t nz = yhdr.size(2);
+            ssize_t lo = zrange[job.v*nz + job.first].first, hi = zrange[job.v*nz + job.first].second;
+            for (size_t z = job.first; z < job.last; z++) {
+              lo = std::min(lo, zrange[job.v*nz + z].first);
+              hi = std::max(hi, zrange[job.v*nz + z].second);
+            }
+            bricks.planes(lo, hi, r0, nr);
+          }
+
+          /* Thread-local state of the projection of a volume, or a chunk of its slices. The
+           * recon planes in their footprint (the slab, nr x ncoefs) are contracted with the
+           * q-space projections of all ne shots of the volume (Q, ncoefs x ne) in one matrix
+           * product, into ne scalar images S from which the slices are then interpolated. The
+           * adjoint accumulates into ne scalar images A, which are expanded with A Q^T and
+           * written back one recon plane at a time, under a lock per plane. N is the no.
+           * coefficients, as in QSpace<N>::Mapping. */
+          template <int N>
+          class VolumeSlab
+          {
+            MEMALIGN(VolumeSlab<N>)
+            public:
+              VolumeSlab (const ReconMapping& map, const float* Xin, float* Xout, Adapter::RowLocks* lock,
+                          const vector<std::pair<ssize_t,ssize_t>>& zrange)
+                : map (map), fp (map.footprint()), Xin (Xin), Xout (Xout), lock (lock), zrange (zrange),
+                  nc (map.xhdr.size(3)), nxy (map.yhdr.size(0) * map.yhdr.size(1)),
+                  rxy (map.xhdr.size(0) * map.xhdr.size(1)) { }
+
+              VolumeSlab (const VolumeSlab& other)
+                : VolumeSlab (other.map, other.Xin, other.Xout, other.lock, other.zrange) { }
+
+              //! select the slab of the slices in job, and contract it in the forward projection
+              void select (const ShotJob& job) {
+                v = job.v;
+                map.slab_planes(job, zrange, r0, nr);
+                Q.resize(nc, map.ne);
+                for (size_t e = 0; e < map.ne; e++)
+                  Q.col(e) = map.qbasis.get_projection(v*map.ne + e);
+                if (Xin)
+                  S.noalias() = Eigen::Map<const RowMatrixNf<N>> (Xin + r0*nc, nr, nc) * Q;
+                else
+                  A.setZero(nr, map.ne);
+              }
+
+              //! prediction of source slice z
+              void predict (size_t z, Eigen::VectorXf& out) {
+                const size_t e = z % map.ne;
+                out.setZero(nxy);
+                fp.set_shotidx(v*map.ne + e);
+                map.slice_footprint(fp, v, z, [&](size_t j, size_t r, float w) { out[j] += w * S(r - r0, e); });
+              }
+
+              //! adjoint of the prediction of source slice z
+              void adjoint (size_t z, const Eigen::VectorXf& in) {
+                const size_t e = z % map.ne;
+                fp.set_shotidx(v*map.ne + e);
+                map.slice_footprint(fp, v, z, [&](size_t j, size_t r, float w) { A(r - r0, e) += w * in[j]; });
+              }
+
+              //! X += A Q^T, under one lock per recon plane (on its first row)
+              void writeback () {
+                for (size_t p = 0; p < nr; p += rxy) {
+                  if ((A.middleRows(p, rxy).array() == 0.0f).all()) continue;
+                  B.noalias() = A.middleRows(p, rxy) * Q.transpose();
+                  Adapter::RowLock guard (*lock, r0 + p);
+                  Eigen::Map<RowMatrixNf<N>> (Xout + (r0 + p)*nc, rxy, nc) += B;
+                }
+              }
+
+            private:
+              const ReconMapping& map;
+              MotionFootprint fp;
+              const float* Xin;
+              float* Xout;
+              Adapter::RowLocks* lock;
+              const vector<std::pair<ssize_t,ssize_t>>& zrange;
+              const size_t nc, nxy, rxy;
+              size_t v, r0, nr;
+              Eigen::Matrix<float, N, Eigen::Dynamic> Q;
+              Eigen::MatrixXf S, A;
+              RowMatrixNf<N> B;
+          };
+
+          template <int N, typename ImageType2>
+          void x2y_volume(const float* X, ImageType2& Y) const
+          {
+            const vector<std::pair<ssize_t,ssize_t>> zrange = slice_zrange();
+
+            struct VolumeX2Y {   MEMALIGN(VolumeX2Y);
+              ImageType2 out;
+              VolumeSlab<N> slab;
+              const vector<size_t>& axslice;
+              Eigen::VectorXf pred;
+              void operator() (const ShotJob& job) {
+                slab.select(job);
+                out.index(3) = job.v;
+                for (size_t zz = job.first; zz < job.last; zz++) {
+                  slab.predict(zz, pred);
+                  out.index(2) = zz;
+                  size_t j = 0;
+                  for (auto i = Loop(axslice) (out); i; ++i, ++j)
+                    out.value() += pred[j];
+                }
+              }
+            } func = {Y, VolumeSlab<N> (*this, X, nullptr, nullptr, zrange), slice_axes, {}};
+
+            run_shots ("forward projection", schedule_volumes(), func);
+          }
+
+          template <int N, typename ImageType2>
+          void y2x_volume(float* X, const ImageType2& Y) const
+          {
+            const std::shared_ptr<Adapter::RowLocks> lock = writepool.locks();
+            const vector<std::pair<ssize_t,ssize_t>> zrange = slice_zrange();
+
+            struct VolumeY2X {   MEMALIGN(VolumeY2X);
+              ImageType2 in;
+              VolumeSlab<N> slab;
+              const vector<size_t>& axslice;
+              Eigen::VectorXf val;
+              void operator() (const ShotJob& job) {
+                slab.select(job);
+                in.index(3) = job.v;
+                val.resize(in.size(0) * in.size(1));
+                for (size_t zz = job.first; zz < job.last; zz++) {
+                  in.index(2) = zz;
+                  size_t j = 0;
+                  for (auto i = Loop(axslice) (in); i; ++i, ++j)
+                    val[j] = in.value();
+                  slab.adjoint(zz, val);
+                }
+                slab.writeback();
+              }
+            } func = {Y, VolumeSlab<N> (*this, nullptr, X, lock.get(), zrange), slice_axes, {}};
+
+            run_shots ("transpose projection", schedule_volumes(), func);
+          }
+
+          /* Group the shots with equal motion parameters (up to DEFAULT_GROUP_QUANT), e.g. all
+           * shots before motion correction, or all excitations of a volume with volume-level
+           * motion. The grouped projections resample all ncoefs channels of the recon once per
+           * source slice of a group, and contract them with the q-space projections of all its
+           * shots in one matrix product. That takes ncoefs times the work of the resampling in a
+           * shot-wise projection, but saves the resampling and the lazy q-space projection of
+           * the recon voxels in all other shots. Returns true if the estimated cost, per source
+           * voxel, is lower than that of the shot-wise projections. */
+          bool group_shots()
+          {
+            std::map<vector<int64_t>, size_t> index;
+            groups.clear();
+            for (size_t s = 0; s < size_t(motion.rows()); s++) {
+              vector<int64_t> key (motion.cols());
+              for (size_t p = 0; p < key.size(); p++)
+                key[p] = std::llround(motion(s,p) / DEFAULT_GROUP_QUANT);
+              auto g = index.emplace(key, groups.size());
+              if (g.second) groups.emplace_back();
+              groups[g.first->second].push_back(s);
+            }
+            const size_t nc = xhdr.size(3), ntaps = 2*ssp.size()+1;
+            MotionFootprint fp = footprint();
+            default_type pershot = 0, grouped = 0;
+            for (const auto& g : groups) {
+              fp.set_shotidx(g[0]);
+              // footprint size, and no. recon planes per source slice
+              const size_t F = fp.grid_aligned() ? ntaps : fp.size();
+              const size_t P = fp.grid_aligned() ? ntaps : ntaps + ((kernel == INTERP_LINEAR) ? 1 : 3);
+              vector<bool> excitation (ne, false);
+              for (auto s : g) excitation[s%ne] = true;
+              pershot += g.size() * (F + P*nc);
+              grouped += std::count(excitation.begin(), excitation.end(), true) * F*nc + g.size() * nc;
+            }
+            if (grouped > pershot)
+              return false;
+            INFO("Projecting " + str(motion.rows()) + " shots in " + str(groups.size()) + " motion groups.");
+            return true;
+          }
+
+          //! jobs for all source slices of all groups, sorted by decreasing no. shots
+          vector<GroupJob> schedule_groups() const
+          {
+            const size_t nz = yhdr.size(2), nc = xhdr.size(3);
+            vector<GroupJob> jobs;
+            for (size_t g = 0; g < groups.size(); g++) {
+              for (size_t z = 0; z < nz; z++) {
+                size_t m = 0;
+                for (auto s : groups[g])
+                  m += (s%ne == z%ne);
+                if (m) jobs.push_back({g, z, float(m + nc)});
+              }
+            }
+            std::stable_sort(jobs.begin(), jobs.end(),
+                             [](const GroupJob& a, const GroupJob& b) { return a.cost > b.cost; });
+            return jobs;
+          }
+
+          /* Thread-local state of the grouped projection of one source slice. The recon
+           * coefficients are resampled to the source slice (R, nxy x ncoefs) and contracted
+           * with the q-space projections of the m shots that acquired it (Q, ncoefs x m) into
+           * the predictions P = R Q. In the adjoint, G = P Q^T is scattered into the recon under
+           * per-voxel locks, after collecting it on the recon planes in the footprint of the slice.
+           * N is the no. coefficients, as in QSpace<N>::Mapping. */
+          template <int N>
+          class GroupedSlice
+          {
+            MEMALIGN(GroupedSlice<N>)
+            public:
+              GroupedSlice (const ReconMapping& map, const float* Xin, float* Xout, Adapter::RowLocks* lock,
+                            const vector<std::pair<ssize_t,ssize_t>>* zrange)
+                : map (map), fp (map.footprint()), Xin (Xin), Xout (Xout), lock (lock), zrange (zrange),
+                  nc (map.xhdr.size(3)), nx (map.yhdr.size(0)), ny (map.yhdr.size(1)), nz (map.yhdr.size(2)) { }
+
+              GroupedSlice (const GroupedSlice& other)
+                : GroupedSlice (other.map, other.Xin, other.Xout, other.lock, other.zrange) { }
+
+              /* Select the shots of the group that acquired slice job.z (with nonzero weight in
+               * W, if given), and return their number. */
+              size_t select (const GroupJob& job, const Eigen::MatrixXf* W = nullptr) {
+                z = job.z;
+                shots.clear();
+                for (auto s : map.groups[job.group])
+                  if (s%map.ne == z%map.ne && (!W || (*W)(z, s/map.ne) != 0.0f))
+                    shots.push_back(s);
+                if (shots.empty()) return 0;
+                fp.set_shotidx(shots[0]);
+                Q.resize(nc, shots.size());
+                for (size_t c = 0; c < shots.size(); c++)
+                  Q.col(c) = map.qbasis.get_projection(shots[c]);
+                P.resize(nx*ny, shots.size());
+                return shots.size();
+              }
+
+              //! volume of selected shot c
+              size_t volume (size_t c) const { return shots[c] / map.ne; }
+
+              //! predictions of the slice in all selected shots (nxy x m)
+              Eigen::MatrixXf& prediction () { return P; }
+
+              //! P = R Q
+              void predict () {
+                const Eigen::Map<const RowMatrixNf<N>> X (Xin, map.cols() / nc, nc);
+                R.setZero(nx*ny, nc);
+                footprint([&](size_t j, size_t r, float w) { R.row(j) += w * X.row(r); });
+                P.noalias() = R * Q;
+              }
+
+              //! X += R^T P Q^T
+              void adjoint () {
+                G.noalias() = P * Q.transpose();
+                const std::pair<ssize_t,ssize_t> zr = (*zrange)[volume(0)*nz + z];
+                size_t r0, nr;
+                map.bricks.planes(zr.first, zr.second, r0, nr);
+                accum.setZero(nr, nc);
+                touched.assign(nr, 0);
+                footprint([&](size_t j, size_t r, float w) {
+                  accum.row(r - r0) += w * G.row(j);
+                  touched[r - r0] = 1;
+                });
+                for (size_t i = 0; i < nr; i++) {
+                  if (!touched[i]) continue;
+                  Adapter::RowLock guard (*lock, r0 + i);
+                  Eigen::Map<row_type> (Xout + (r0 + i)*nc, nc) += accum.row(i);
+                }
+              }
+
+            private:
+              const ReconMapping& map;
+              MotionFootprint fp;
+              const float* Xin;
+              float* Xout;
+              Adapter::RowLocks* lock;
+              const vector<std::pair<ssize_t,ssize_t>>* zrange;
+              const size_t nc, nx, ny, nz;
+              size_t z;
+              vector<size_t> shots;
+              using row_type = Eigen::Matrix<float, 1, N, Eigen::RowMajor | Eigen::DontAlign>;
+              Eigen::Matrix<float, N, Eigen::Dynamic> Q;
+              Eigen::MatrixXf P;
+              RowMatrixNf<N> R, G, accum;
+              vector<uint8_t> touched;
+
+              template <class Functor>
+              void footprint (Functor&& f) { map.slice_footprint(fp, volume(0), z, f); }
+          };
+
+          template <int N, typename ImageType2>
+          void x2y_grouped(const float* X, ImageType2& Y) const
+          {
+            struct GroupedX2Y {   MEMALIGN(GroupedX2Y);
+              ImageType2 out;
+              GroupedSlice<N> slice;
+              const vector<size_t>& axslice;
+              void operator() (const GroupJob& job) {
+                if (!slice.select(job)) return;
+                slice.predict();
+                for (size_t c = 0; c < size_t(slice.prediction().cols()); c++) {
+                  out.index(3) = slice.volume(c);
+                  out.index(2) = job.z;
+                  size_t j = 0;
+                  for (auto i = Loop(axslice) (out); i; ++i, ++j)
+                    out.value() += slice.prediction()(j,c);
+                }
+              }
+            } func = {Y, GroupedSlice<N> (*this, X, nullptr, nullptr, nullptr), slice_axes};
+
+            run_shots ("forward projection", schedule_groups(), func);
+          }
+
+          template <int N, typename ImageType2>
+          void y2x_grouped(float* X, const ImageType2& Y) const
+          {
+            const std::shared_ptr<Adapter::RowLocks> lock = writepool.locks();
+            const vector<std::pair<ssize_t,ssize_t>> zrange = slice_zrange();
+
+            struct GroupedY2X {   MEMALIGN(GroupedY2X);
+              ImageType2 in;
+              GroupedSlice<N> slice;
+              const vector<size_t>& axslice;
+              void operator() (const GroupJob& job) {
+                if (!slice.select(job)) return;
+                for (size_t c = 0; c < size_t(slice.prediction().cols()); c++) {
+                  in.index(3) = slice.volume(c);
+                  in.index(2) = job.z;
+                  size_t j = 0;
+                  for (auto i = Loop(axslice) (in); i; ++i, ++j)
+                    slice.prediction()(j,c) = in.value();
+                }
+                slice.adjoint();
+              }
+            } func = {Y, GroupedSlice<N> (*this, nullptr, X, lock.get(), &zrange), slice_axes};
+
+            run_shots ("transpose projection", schedule_groups(), func);
+          }
+
+          template <int N>
+          void x2x_grouped(float* X, const float* Xin, const Eigen::MatrixXf& W, const Eigen::VectorXf& Wvox) const
+          {
+            const std::shared_ptr<Adapter::RowLocks> lock = writepool.locks();
+            const vector<std::pair<ssize_t,ssize_t>> zrange = slice_zrange();
+
+            struct GroupedX2X {   MEMALIGN(GroupedX2X);
+              GroupedSlice<N> slice;
+              const Eigen::MatrixXf& W;
+              const Eigen::VectorXf& Wvox;
+              size_t nxy, nz;
+              void operator() (const GroupJob& job) {
+                if (!slice.select(job, &W)) return;
+                slice.predict();
+                for (size_t c = 0; c < size_t(slice.prediction().cols()); c++) {
+                  const size_t v = slice.volume(c);
+                  slice.prediction().col(c).array() *= W(job.z,v) * Wvox.segment((v*nz + job.z)*nxy, nxy).array();
+                }
+                slice.adjoint();
+              }
+            } func = {GroupedSlice<N> (*this, Xin, X, lock.get(), &zrange), W, Wvox,
+                      size_t(yhdr.size(0)*yhdr.size(1)), size_t(yhdr.size(2))};
+
+            run_shots ("normal projection", schedule_groups(), func);
+          }
+
+
+          enum MultiMode { MULTI_FORWARD, MULTI_TRANSPOSE, MULTI_NORMAL };
+
+          /* Thread-local state of the multi-image projection of one shot, as in CachedShot, but
+           * with k scalar projections and adjoint accumulators per recon voxel. These are only
+           * kept for the recon voxels in the footprint of the current job, in slots that are
+           * assigned on first use and released in flush(). The slot of each recon voxel is
+           * looked up in a dense per-thread index. */
+          class MultiShot
+          {
+            MEMALIGN(MultiShot)
+            public:
+              MultiShot (const ReconMapping& map, const RowMatrixXf* Xin, RowMatrixXf* Xout, Adapter::RowLocks* lock, size_t k)
+                : map (map), fp (map.footprint()), Xin (Xin), Xout (Xout), lock (lock),
+                  k (k), nc (map.xhdr.size(3)), rx (map.xhdr.size(0)), ry (map.xhdr.size(1)),
+                  slots (make_slots(voxel_count(map.xhdr, 0, 3))) { }
+
+              MultiShot (const MultiShot& other)
+                : MultiShot (other.map, other.Xin, other.Xout, other.lock, other.k) { }
+
+              void set_shotidx (size_t idx) {
+                flush();
+                fp.set_shotidx(idx);
+                qr = map.qbasis.get_projection(idx);
+              }
+
+              // collect the footprint of source voxel (x, y, z), with linear index j
+              FORCE_INLINE void footprint (ssize_t x, ssize_t y, ssize_t z, size_t j) {
+                entries.clear();
+                if (map.cached() && !map.bricks.active()) {
+                  const size_t width = map.cache_idx.size() / map.rows();
+                  for (size_t e = j*width; e < j*width + map.cache_len[j]; e++)
+                    entries.emplace_back(slot(map.cache_idx[e]), map.cache_wgt[e]);
+                } else {
+                  fp(x, y, z, [&](ssize_t a, ssize_t b, ssize_t c, float w) {
+                    entries.emplace_back(slot((c*ry + b)*rx + a), w);
+                  });
+                }
+              }
+
+              // predictions of the current source voxel in all k images
+              FORCE_INLINE void value (Eigen::Ref<Eigen::RowVectorXf> out) {
+                out.setZero();
+                for (const auto& e : entries) {
+                  if (!loaded[e.first]) {
+                    Eigen::Map<const RowMatrixXf> Xi (Xin->row(voxels[e.first]).data(), k, nc);
+                    proj.row(e.first).noalias() = (Xi * qr).transpose();
+                    loaded[e.first] = 1;
+                  }
+                  out += e.second * proj.row(e.first);
+                }
+              }
+
+              // adjoint of the predictions of the current source voxel
+              FORCE_INLINE void adjoint_add (const Eigen::Ref<const Eigen::RowVectorXf>& val) {
+                for (const auto& e : entries) {
+                  touched[e.first] = 1;
+                  accum.row(e.first) += e.second * val;
+                }
+              }
+
+              void flush () {
+                const size_t n = voxels.size();
+                for (size_t s = 0; s < n; s++) {
+                  if (!touched[s]) continue;
+                  Adapter::RowLock guard (*lock, voxels[s]);
+                  Eigen::Map<RowMatrixXf> (Xout->row(voxels[s]).data(), k, nc).noalias() += accum.row(s).transpose() * qr.transpose();
+                }
+                accum.topRows(n).setZero();
+                std::fill_n(loaded.begin(), n, 0);
+                std::fill_n(touched.begin(), n, 0);
+                for (auto r : voxels)
+                  (*slots)[r] = none;
+                voxels.clear();
+              }
+
+            private:
+              const ReconMapping& map;
+              MotionFootprint fp;
+              const RowMatrixXf* Xin;
+              RowMatrixXf* Xout;
+              Adapter::RowLocks* lock;
+              const size_t k, nc;
+              const ssize_t rx, ry;
+              Eigen::VectorXf qr;
+              enum : uint32_t { none = std::numeric_limits<uint32_t>::max() };
+              ThreadLocal<vector<uint32_t>> slots;            // recon voxel -> slot, or none
+              vector<uint32_t> voxels;                        // slot -> recon voxel
+              RowMatrixXf proj, accum;                        // k values per slot
+              vector<uint8_t> loaded, touched;
+              vector<std::pair<uint32_t, float>> entries;     // (slot, weight)
+
+              static std::function<vector<uint32_t>()> make_slots (size_t nxyz) {
+                return [nxyz] () { return vector<uint32_t> (nxyz, none); };
+              }
+
+              // slot of recon voxel r, grown geometrically as the footprint of the job grows
+              FORCE_INLINE uint32_t slot (uint32_t r) {
+                uint32_t& s = (*slots)[r];
+                if (s == none) {
+                  s = voxels.size();
+                  voxels.push_back(r);
+                  if (voxels.size() > loaded.size()) {
+                    const size_t n = loaded.size(), cap = std::max(2*n, size_t(1024));
+                    proj.conservativeResize(cap, k);
+                    accum.conservativeResize(cap, k);
+                    accum.bottomRows(cap - n).setZero();
+                    loaded.resize(cap, 0);
+                    touched.resize(cap, 0);
+                  }
+                }
+                return s;
+              }
+          };
+
+          void project_multi(const MultiMode mode, const RowMatrixXf* Xin, RowMatrixXf* X,
+                             const RowMatrixXf* Yin, RowMatrixXf* Yout,
+                             const Eigen::MatrixXf* W, const RowMatrixXf* Wvox) const
+          {
+            const size_t k = (Xin ? Xin->cols() : X->cols()) / xhdr.size(3);
+            const std::shared_ptr<Adapter::RowLocks> lock = writepool.locks();
+
+            struct MultiProject {   MEMALIGN(MultiProject);
+              MultiShot pred;
+              const MultiMode mode;
+              const RowMatrixXf* Yin;
+              RowMatrixXf* Yout;
+              const Eigen::MatrixXf* W;
+              const RowMatrixXf* Wvox;
+              size_t ne, nx, ny, nz, k;
+              void operator() (const ShotJob& job) {
+                const size_t v = job.v;
+                Eigen::RowVectorXf val (k);
+                pred.set_shotidx(job.shot);
+                for (size_t zz = job.first; zz < job.last; zz += ne) {
+                  if (mode == MULTI_NORMAL && (*W)(zz,v) == 0.0f) continue;
+                  size_t j = (v*nz + zz)*nx*ny;
+                  for (size_t y = 0; y < ny; y++) {
+                    for (size_t x = 0; x < nx; x++, j++) {
+                      pred.footprint(x, y, zz, j);
+                      if (mode == MULTI_FORWARD) {
+                        pred.value(val);
+                        Yout->row(j) += val;
+                      } else if (mode == MULTI_TRANSPOSE) {
+                        pred.adjoint_add(Yin->row(j));
+                      } else {
+                        pred.value(val);
+                        pred.adjoint_add((*W)(zz,v) * Wvox->row(j).cwiseProduct(val));
+                      }
+                    }
+                  }
+                }
+                pred.flush();
+              }
+            } func = {MultiShot (*this, Xin, X, lock.get(), k), mode, Yin, Yout, W, Wvox, ne,
+                      size_t(yhdr.size(0)), size_t(yhdr.size(1)), size_t(yhdr.size(2)), k};
+
+            run_shots ("multi-image projection", schedule(mode == MULTI_NORMAL ? W : nullptr), func);
+          }
 
       };
 
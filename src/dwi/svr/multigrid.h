@@ -0,0 +1,247 @@
+/* Copyright (c) 2017-2019 Daan Christiaens
+ *
+ * MRtrix and this add-on module are distributed in the hope
+ * that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __dwi_svr_multigrid_h__
+#define __dwi_svr_multigrid_h__
+
+
+#include <memory>
+#include <Eigen/Dense>
+
+#include "types.h"
+#include "header.h"
+#include "algo/threaded_loop.h"
+
+#include "dwi/svr/recon.h"
+#include "dwi/svr/precond.h"
+
+#define DEFAULT_MG_LEVELS 2
+#define DEFAULT_MG_SMOOTH 1
+#define DEFAULT_MG_COARSE 8
+#define DEFAULT_MG_POWERIT 6
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace SVR
+    {
+
+    /**
+     *  Geometric multigrid preconditioner for the normal equations of the reconstruction.
+     *
+     *  Low-frequency error components converge slowly under CG with the Laplacian regulariser.
+     *  This preconditioner applies one symmetric V-cycle over a hierarchy of recon grids,
+     *  each 2x coarser than the previous, on which the ReconMapping and ReconMatrix are
+     *  rediscretised. Prolongation is piecewise constant and restriction is its transpose.
+     *  Each level is smoothed with damped Jacobi, using the diagonal of its normal matrix and
+     *  a damping factor from a few power iterations, so that the V-cycle remains symmetric
+     *  positive definite for use in ConjugateGradient.
+     */
+    class MultigridPreconditioner
+    {  MEMALIGN(MultigridPreconditioner);
+    public:
+      typedef float Scalar;
+      typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+      using RowMatrixXf = ReconMatrix::RowMatrixXf;
+
+      MultigridPreconditioner () { }
+
+      template <typename MatType>
+      explicit MultigridPreconditioner (const MatType& mat) { compute(mat); }
+
+      template <typename MatType>
+      MultigridPreconditioner& analyzePattern (const MatType&) { return *this; }
+
+      template <typename MatType>
+      MultigridPreconditioner& factorize (const MatType& mat) { return compute(mat); }
+
+      template <typename MatType>
+      MultigridPreconditioner& compute (const MatType& mat)
+      {
+        const ReconMatrix& R = recon_matrix(mat);
+        levels.clear();
+        levels.emplace_back(new Level (R));
+        for (size_t l = 0; l < DEFAULT_MG_LEVELS; l++) {
+          const Header& fine = levels.back()->matrix().mapping().xheader();
+          if (fine.size(0) < 8 || fine.size(1) < 8 || fine.size(2) < 4)
+            break;
+          levels.emplace_back(Level::coarsen (*levels.back()));
+        }
+        INFO("Multigrid preconditioner with " + str(levels.size()) + " levels.");
+        for (auto& level : levels)
+          level->init();
+        return *this;
+      }
+
+      template <typename Rhs>
+      inline const Vector solve (const Rhs& b) const
+      {
+        eigen_assert(levels.size() && "MultigridPreconditioner is not initialized.");
+        Vector x (b.size());
+        vcycle(0, b, x);
+        return x;
+      }
+
+      Eigen::ComputationInfo info () { return Eigen::Success; }
+
+    private:
+
+      class Level
+      {  MEMALIGN(Level);
+      public:
+        // finest level
+        Level (const ReconMatrix& R)
+          : recmat (&R) { }
+
+        // next coarser level: half the grid size, with voxel centres shifted accordingly
+        static Level* coarsen (const Level& fine)
+        {
+          const Header& f = fine.recmat->mapping().xheader();
+          Level* level = new Level (nullptr);
+          level->hdr.reset (new Header (f));
+          Eigen::Vector3d offset;
+          for (size_t k = 0; k < 3; k++) {
+            level->hdr->size(k) = (f.size(k) + 1) / 2;
+            level->hdr->spacing(k) = 2 * f.spacing(k);
+            offset[k] = 0.5 * f.spacing(k);
+          }
+          level->hdr->transform().translation() += level->hdr->transform().linear() * offset;
+          level->map.reset (new ReconMapping (fine.recmat->mapping(), *level->hdr));
+          level->coarse.reset (new ReconMatrix (*level->map, *fine.recmat));
+          level->recmat = level->coarse.get();
+          return level;
+        }
+
+        const ReconMatrix& matrix () const { return *recmat; }
+
+        void init () {
+          jacobi.compute(*recmat);
+          omega = 1.0f / max_eigenvalue();
+          DEBUG("multigrid level " + str(recmat->mapping().xheader().size(0)) + ": omega = " + str(omega));
+        }
+
+        // y = A x
+        void apply (const Vector& x, Vector& y) const {
+          y.setZero();
+          recmat->normal().project(y, x);
+        }
+
+        // x += omega D^-1 r
+        void smooth (Vector& x, const Vector& r) const {
+          x += omega * jacobi.solve(r);
+        }
+
+      private:
+        Level (std::nullptr_t) : recmat (nullptr) { }
+
+        std::unique_ptr<Header> hdr;
+        std::unique_ptr<ReconMapping> map;
+        std::unique_ptr<ReconMatrix> coarse;
+        const ReconMatrix* recmat;
+        JacobiPreconditioner jacobi;
+        float omega;
+
+        // largest eigenvalue of D^-1 A, from a few power iterations
+        float max_eigenvalue () const {
+          Vector v = Vector::Random(recmat->cols()).cwiseAbs();
+          Vector w (v.size());
+          float lambda = 1.0f;
+          for (size_t n = 0; n < DEFAULT_MG_POWERIT; n++) {
+            v.normalize();
+            apply(v, w);
+            w = jacobi.solve(w);
+            lambda = w.norm();
+            v.swap(w);
+          }
+          return lambda;
+        }
+      };
+
+      vector<std::unique_ptr<Level>> levels;
+
+
+      // x = M^-1 b at level l, starting from zero
+      void vcycle (size_t l, const Vector& b, Vector& x) const
+      {
+        const Level& level = *levels[l];
+        x.setZero();
+        Vector r (b);
+        if (l == levels.size()-1) {
+          for (size_t n = 0; n < DEFAULT_MG_COARSE; n++)
+            sweep(level, b, x, r, n);
+          return;
+        }
+        for (size_t n = 0; n < DEFAULT_MG_SMOOTH; n++)
+          sweep(level, b, x, r, n);
+        level.apply(x, r);
+        r = b - r;
+        // coarse-grid correction
+        const Level& coarse = *levels[l+1];
+        Vector bc (coarse.matrix().cols()), xc (bc.size());
+        bc.setZero();
+        transfer(level, coarse, r, bc, true);
+        vcycle(l+1, bc, xc);
+        transfer(level, coarse, x, xc, false);
+        for (size_t n = 0; n < DEFAULT_MG_SMOOTH; n++)
+          sweep(level, b, x, r, n+1);
+      }
+
+      // one Jacobi sweep; the residual of a zero initial guess is b itself
+      void sweep (const Level& level, const Vector& b, Vector& x, Vector& r, size_t n) const
+      {
+        if (n > 0) {
+          level.apply(x, r);
+          r = b - r;
+        }
+        level.smooth(x, r);
+      }
+
+      /* Restriction (fine to coarse, summing the children of each coarse voxel) or
+       * prolongation (coarse to fine, piecewise constant), threaded over coarse lines
+       * so that every thread writes to its own voxels. */
+      void transfer (const Level& fine, const Level& coarse, Vector& xf, Vector& xc, bool restrict) const
+      {
+        const Header& hf = fine.matrix().mapping().xheader();
+        const Header& hc = coarse.matrix().mapping().xheader();
+        struct Transfer {   MEMALIGN(Transfer);
+          const Header& hf;
+          const Header& hc;
+          Eigen::Map<RowMatrixXf> Xf, Xc;
+          const bool restrict;
+          void operator() (Iterator& pos) {
+            const ssize_t y = pos.index(1), z = pos.index(2);
+            for (ssize_t zf = 2*z; zf < std::min(2*z+2, ssize_t(hf.size(2))); zf++) {
+              for (ssize_t yf = 2*y; yf < std::min(2*y+2, ssize_t(hf.size(1))); yf++) {
+                size_t jf = (zf*hf.size(1) + yf) * hf.size(0);
+                size_t jc = (z*hc.size(1) + y) * hc.size(0);
+                for (ssize_t xf = 0; xf < hf.size(0); xf++, jf++) {
+                  if (restrict) Xc.row(jc + xf/2) += Xf.row(jf);
+                  else          Xf.row(jf) += Xc.row(jc + xf/2);
+                }
+              }
+            }
+          }
+        } func = {hf, hc,
+                  Eigen::Map<RowMatrixXf> (xf.data(), voxel_count(hf, 0, 3), hf.size(3)),
+                  Eigen::Map<RowMatrixXf> (xc.data(), voxel_count(hc, 0, 3), hc.size(3)),
+                  restrict};
+        ThreadedLoop (hc, vector<size_t>({1, 2}), vector<size_t>({0})).run_outer (func);
+      }
+
+    };
+
+
+    }
+  }
+}
+
+
+#endif
+
@@ -0,0 +1,305 @@
+/* Copyright (c) 2017-2019 Daan Christiaens
+ *
+ * MRtrix and this add-on module are distributed in the hope
+ * that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __dwi_svr_precond_h__
+#define __dwi_svr_precond_h__
+
+
+#include <algorithm>
+#include <Eigen/Dense>
+
+#include "types.h"
+#include "algo/threaded_loop.h"
+
+#include "dwi/svr/recon.h"
+#include "dwi/svr/bsr.h"
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace SVR
+    {
+
+    /**
+     *  Accumulate, for every recon voxel j, the weighted sum of squared footprint weights
+     *  S_j = sum_i W_i a_ij^2 over the source voxels i of one shot, or of a job of its slices
+     *  (see ReconMapping::schedule()). Since all source voxels in a shot share the same q-space
+     *  projection q, the contribution of that shot to the ncoefs x ncoefs diagonal block of
+     *  R^T W R in voxel j is S_j q q^T. The Target decides which part of that block to keep,
+     *  through add(j, S_j, q); calls are serialised per voxel with a lock.
+     */
+    template <class Target>
+    struct VoxelGramAccumulator {   MEMALIGN(VoxelGramAccumulator);
+      VoxelGramAccumulator (const ReconMatrix& R, Target& target, Adapter::RowLocks* lock)
+        : map (R.mapping()), fp (map.footprint()), W (R.getWeights()), Wvox (R.getVoxelWeights()),
+          target (target), lock (lock), S (make_scratch(voxel_count(map.xheader(), 0, 3))) { }
+
+      void operator() (const ShotJob& job) {
+        const size_t ne = map.excitations(), v = job.v;
+        const ssize_t nx = map.yheader().size(0), ny = map.yheader().size(1), nz = map.yheader().size(2);
+        const ssize_t rx = map.xheader().size(0), ry = map.xheader().size(1);
+        fp.set_shotidx(job.shot);
+        for (ssize_t zz = job.first; zz < ssize_t(job.last); zz += ne) {
+          if (W(zz,v) == 0.0f) continue;
+          size_t j = (v*nz + zz)*nx*ny;
+          for (ssize_t y = 0; y < ny; y++) {
+            for (ssize_t x = 0; x < nx; x++, j++) {
+              if (Wvox[j] == 0.0f) continue;
+              entries.clear();
+              fp(x, y, zz, [&](ssize_t a, ssize_t b, ssize_t c, float w) {
+                entries.emplace_back((c*ry + b)*rx + a, w);
+              });
+              // merge repeated voxels before squaring
+              std::sort(entries.begin(), entries.end());
+              size_t n = 0;
+              for (size_t i = 1; i < entries.size(); i++) {
+                if (entries[i].first == entries[n].first) entries[n].second += entries[i].second;
+                else entries[++n] = entries[i];
+              }
+              entries.resize(n+1);
+              float ws = W(zz,v) * Wvox[j];
+              for (const auto& e : entries) {
+                Scratch& s = (*S)[e.first];
+                if (!s.touched) { s.touched = 1; rows.push_back(e.first); }
+                s.sum += ws * e.second * e.second;
+              }
+            }
+          }
+        }
+        flush(map.basis().get_projection(job.shot));
+      }
+
+      private:
+        const ReconMapping& map;
+        MotionFootprint fp;
+        const Eigen::MatrixXf& W;
+        const Eigen::VectorXf& Wvox;
+        Target& target;
+        Adapter::RowLocks* lock;
+        struct Scratch { float sum; uint8_t touched; };
+        ThreadLocal<vector<Scratch>> S;   // per recon voxel
+        vector<size_t> rows;
+        vector<std::pair<size_t, float>> entries;
+
+        static std::function<vector<Scratch>()> make_scratch (size_t nxyz) {
+          return [nxyz] () { return vector<Scratch> (nxyz, Scratch {0.0f, 0}); };
+        }
+
+        void flush (const Eigen::Ref<const Eigen::VectorXf>& q) {
+          for (size_t j : rows) {
+            Scratch& s = (*S)[j];
+            s.touched = 0;
+            if (s.sum == 0.0f) continue;
+            Adapter::RowLock guard (*lock, j);
+            target.add(j, s.sum, q);
+            s.sum = 0.0f;
+          }
+          rows.clear();
+        }
+    };
+
+
+    template <class Target>
+    void accumulate_voxel_gram (const ReconMatrix& R, Target& target, const std::string& msg)
+    {
+      const std::shared_ptr<Adapter::RowLocks> lock = R.mapping().locks();
+      VoxelGramAccumulator<Target> func (R, target, lock.get());
+      run_shots (msg, R.mapping().schedule(&R.getWeights(), &R.getVoxelWeights()), func);
+    }
+
+
+    // the reconstruction matrix underlying any of the operators used in dwirecon
+    inline const ReconMatrix& recon_matrix (const ReconMatrix& R)          { return R; }
+    inline const ReconMatrix& recon_matrix (const ReconMatrixNormal& N)    { return N.matrix(); }
+    inline const ReconMatrix& recon_matrix (const ReconMatrixBSR& N)       { return N.matrix(); }
+
+
+
+    /**
+     *  Jacobi preconditioner for the SHARD reconstruction: the inverse of the diagonal of
+     *  R^T R, i.e., of the squared column norms of the weighted and regularised ReconMatrix.
+     *  The same diagonal serves LeastSquaresConjugateGradient on R and ConjugateGradient on
+     *  the normal operators, so compute() accepts any of them.
+     */
+    class JacobiPreconditioner
+    {  MEMALIGN(JacobiPreconditioner);
+    public:
+      typedef float Scalar;
+      typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+      JacobiPreconditioner () : initialized (false) { }
+
+      template <typename MatType>
+      explicit JacobiPreconditioner (const MatType& mat) { compute(mat); }
+
+      template <typename MatType>
+      JacobiPreconditioner& analyzePattern (const MatType&) { return *this; }
+
+      template <typename MatType>
+      JacobiPreconditioner& factorize (const MatType& mat) { return compute(mat); }
+
+      template <typename MatType>
+      JacobiPreconditioner& compute (const MatType& mat)
+      {
+        const ReconMatrix& R = recon_matrix(mat);
+        const size_t nc = R.mapping().xheader().size(3);
+        invdiag.setZero(R.cols());
+        Eigen::Map<ReconMatrix::RowMatrixXf> D (invdiag.data(), invdiag.size() / nc, nc);
+        DiagonalTarget target = {D};
+        accumulate_voxel_gram(R, target, "computing Jacobi preconditioner");
+        R.regularisers_diagonal_add(invdiag);
+        for (Eigen::Index i = 0; i < invdiag.size(); i++)
+          invdiag[i] = (invdiag[i] > 0.0f) ? 1.0f / invdiag[i] : 1.0f;
+        initialized = true;
+        return *this;
+      }
+
+      template <typename Rhs>
+      inline const Vector solve (const Rhs& b) const
+      {
+        eigen_assert(initialized && "JacobiPreconditioner is not initialized.");
+        return invdiag.cwiseProduct(b);
+      }
+
+      Eigen::ComputationInfo info () { return Eigen::Success; }
+
+    private:
+      Vector invdiag;
+      bool initialized;
+
+      struct DiagonalTarget {
+        Eigen::Map<ReconMatrix::RowMatrixXf> D;
+        void add (size_t j, float s, const Eigen::Ref<const Eigen::VectorXf>& q) {
+          D.row(j) += s * q.cwiseAbs2().transpose();
+        }
+      };
+    };
+
+
+
+    /**
+     *  Block-Jacobi preconditioner for the SHARD reconstruction. The ncoefs coefficients of
+     *  one voxel are strongly coupled through the q-space basis, so rather than the diagonal,
+     *  this keeps the full ncoefs x ncoefs diagonal block of R^T R in every recon voxel. Each
+     *  block is factorised once (Cholesky) in compute(), and solve() applies all blocks in
+     *  parallel. Memory use is ncoefs^2 floats per recon voxel.
+     */
+    class BlockJacobiPreconditioner
+    {  MEMALIGN(BlockJacobiPreconditioner);
+    public:
+      typedef float Scalar;
+      typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+      typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> BlockMatrixXf;
+
+      BlockJacobiPreconditioner () : hdr (nullptr), nc (0) { }
+
+      template <typename MatType>
+      explicit BlockJacobiPreconditioner (const MatType& mat) { compute(mat); }
+
+      template <typename MatType>
+      BlockJacobiPreconditioner& analyzePattern (const MatType&) { return *this; }
+
+      template <typename MatType>
+      BlockJacobiPreconditioner& factorize (const MatType& mat) { return compute(mat); }
+
+      template <typename MatType>
+      BlockJacobiPreconditioner& compute (const MatType& mat)
+      {
+        const ReconMatrix& R = recon_matrix(mat);
+        hdr = &R.mapping().xheader();
+        nc = hdr->size(3);
+        size_t nxyz = voxel_count(*hdr, 0, 3);
+        blocks.assign(nxyz * nc * nc, 0.0f);
+        BlockTarget target = {*this};
+        accumulate_voxel_gram(R, target, "computing block-Jacobi preconditioner");
+        // the regularisers only couple voxels, not coefficients
+        Vector rdiag (R.cols()); rdiag.setZero();
+        R.regularisers_diagonal_add(rdiag);
+        struct Factorise {   MEMALIGN(Factorise);
+          BlockJacobiPreconditioner& P;
+          const Vector& rdiag;
+          void operator() (Iterator& pos) {
+            const size_t nx = P.hdr->size(0);
+            size_t j = (pos.index(2)*P.hdr->size(1) + pos.index(1)) * nx;
+            for (size_t x = 0; x < nx; x++, j++) {
+              auto B = P.block(j);
+              B.diagonal() += rdiag.segment(j*P.nc, P.nc);
+              Eigen::LLT<BlockMatrixXf> llt (B);
+              if (llt.info() == Eigen::Success) {
+                B = llt.matrixL();
+              } else {
+                // rank-deficient block: fall back to the diagonal
+                Vector d = B.diagonal();
+                B.setZero();
+                for (size_t c = 0; c < P.nc; c++)
+                  B(c,c) = (d[c] > 0.0f) ? std::sqrt(d[c]) : 1.0f;
+              }
+            }
+          }
+        } func = {*this, rdiag};
+        ThreadedLoop ("factorising block-Jacobi preconditioner", *hdr, vector<size_t>({1, 2}), vector<size_t>({0}))
+          .run_outer (func);
+        return *this;
+      }
+
+      template <typename Rhs>
+      inline const Vector solve (const Rhs& b) const
+      {
+        eigen_assert(hdr && "BlockJacobiPreconditioner is not initialized.");
+        Vector x = b;
+        struct BlockSolve {   MEMALIGN(BlockSolve);
+          const BlockJacobiPreconditioner& P;
+          Vector& x;
+          void operator() (Iterator& pos) {
+            const size_t nx = P.hdr->size(0);
+            size_t j = (pos.index(2)*P.hdr->size(1) + pos.index(1)) * nx;
+            for (size_t x0 = 0; x0 < nx; x0++, j++) {
+              auto L = P.block(j);
+              auto xj = x.segment(j*P.nc, P.nc);
+              L.template triangularView<Eigen::Lower>().solveInPlace(xj);
+              L.transpose().template triangularView<Eigen::Upper>().solveInPlace(xj);
+            }
+          }
+        } func = {*this, x};
+        ThreadedLoop (*hdr, vector<size_t>({1, 2}), vector<size_t>({0})).run_outer (func);
+        return x;
+      }
+
+      Eigen::ComputationInfo info () { return Eigen::Success; }
+
+    private:
+      const Header* hdr;
+      size_t nc;
+      vector<float> blocks;
+
+      FORCE_INLINE Eigen::Map<BlockMatrixXf> block (size_t j) {
+        return Eigen::Map<BlockMatrixXf> (blocks.data() + j*nc*nc, nc, nc);
+      }
+
+      FORCE_INLINE Eigen::Map<const BlockMatrixXf> block (size_t j) const {
+        return Eigen::Map<const BlockMatrixXf> (blocks.data() + j*nc*nc, nc, nc);
+      }
+
+      struct BlockTarget {
+        BlockJacobiPreconditioner& P;
+        void add (size_t j, float s, const Eigen::Ref<const Eigen::VectorXf>& q) {
+          P.block(j).noalias() += s * q * q.transpose();
+        }
+      };
+    };
+
+
+    }
+  }
+}
+
+
+#endif
+
@@ -10,7 +10,10 @@
 #define __dwi_svr_psf_h__
 
 
+#include <array>
 #include <cmath>
+#include <type_traits>
+#include <utility>
 
 #include "types.h"
 
@@ -77,6 +80,70 @@ namespace MR
     };
 
 
+    /**
+     *  Slice Sensitivity Profile of 2N+1 taps, with the no. taps known at compile time so
+     *  that the loops over its taps unroll. Constructed from an SSP of the same size.
+     */
+    template <int N, typename T = float>
+    struct FixedSSP
+    {
+    public:
+
+        FixedSSP (const SSP<T>& ssp)
+        {
+            assert (ssp.size() == N);
+            for (int z = -N; z <= N; z++)
+                values[N+z] = ssp(z);
+        }
+
+        inline T operator() (const int z) const {
+            return values[N+z];
+        }
+
+        static constexpr int size () {
+            return N;
+        }
+
+
+    private:
+        std::array<T, 2*N+1> values;
+
+    };
+
+
+    /**
+     *  Specialisation on a runtime parameter: call op.template run<V>() for the value V in
+     *  Vs... that equals n, or with V = Default if there is none. This selects the
+     *  compile-time specialisation of a kernel once, e.g. for a whole projection.
+     */
+    template <int Default, int... Vs>
+    struct Specialise;
+
+    template <int Default>
+    struct Specialise<Default>
+    {
+        template <class Op>
+        static void run (const int, Op&& op) { op.template run<Default>(); }
+    };
+
+    template <int Default, int V, int... Vs>
+    struct Specialise<Default, V, Vs...>
+    {
+        template <class Op>
+        static void run (const int n, Op&& op) {
+            if (n == V) op.template run<V>();
+            else Specialise<Default, Vs...>::run (n, std::forward<Op>(op));
+        }
+    };
+
+    //! specialisations on the SSP half-width: 1, 3 or 5 taps, or any (-1)
+    using SpecialiseTaps = Specialise<-1, 0, 1, 2>;
+
+    //! SSP type of the specialisation on H: a FixedSSP<H>, or an SSP for H = -1
+    template <int H, typename T = float>
+    using TapSSP = typename std::conditional<(H < 0), SSP<T>, FixedSSP<(H < 0) ? 0 : H, T>>::type;
+
+
     }
   }
 }
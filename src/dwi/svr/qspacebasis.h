@@ -11,6 +11,8 @@
 
 
 #include <atomic>
+#include <memory>
+#include <mutex>
 #include <algorithm>
 #include <Eigen/Dense>
 
@@ -27,6 +29,132 @@ namespace MR
 {
   namespace Adapter
   {
+    /**
+     *  Spin locks on the rows of a buffer that several threads add to, e.g. the
+     *  coefficients of one recon voxel. Use RowLock to hold the lock on one row.
+     */
+    class RowLocks
+    {
+      NOMEMALIGN
+      public:
+        RowLocks (size_t n) : flags (new std::atomic_flag[n]) {
+          for (size_t i = 0; i < n; i++)
+            flags[i].clear();
+        }
+
+        FORCE_INLINE void lock (size_t i) {
+          while (flags[i].test_and_set(std::memory_order_acquire)) ;
+        }
+
+        FORCE_INLINE void unlock (size_t i) {
+          flags[i].clear(std::memory_order_release);
+        }
+
+      private:
+        std::unique_ptr<std::atomic_flag[]> flags;
+    };
+
+
+    //! lock on row i of locks, for the lifetime of this object
+    class RowLock
+    {
+      NOMEMALIGN
+      public:
+        RowLock (RowLocks& locks, size_t i) : locks (locks), i (i) { locks.lock(i); }
+        RowLock (const RowLock&) = delete;
+        ~RowLock () { locks.unlock(i); }
+
+      private:
+        RowLocks& locks;
+        const size_t i;
+    };
+
+
+    /**
+     *  Pool of scratch buffers for the ReadCache and WriteCache adapters, which are copied
+     *  for every thread in every projection. Buffers are returned to the pool in their
+     *  initial state (e.g. all NaN or all zero) and reused by the next copy, instead of
+     *  allocating and filling fresh volumes every time. The pool also holds the row locks
+     *  shared by all threads that write back to the same parent.
+     *
+     *  Returned buffers and the locks are only kept while a Scope of the pool is open, and
+     *  freed when the last one closes. Every projection opens a Scope for its own duration;
+     *  a solver can open one around all its iterations to reuse them across projections.
+     */
+    template <typename ValueType>
+    class BufferPool
+    {
+      MEMALIGN (BufferPool<ValueType>)
+      public:
+        BufferPool (const Header& header, const ValueType init)
+          : H (header), init (init), scopes (0) { }
+
+        class Scope
+        {
+          NOMEMALIGN
+          public:
+            Scope (BufferPool& pool) : pool (&pool) { pool.open(); }
+            Scope (Scope&& other) : pool (other.pool) { other.pool = nullptr; }
+            Scope (const Scope&) = delete;
+            ~Scope () { if (pool) pool->close(); }
+          private:
+            BufferPool* pool;
+        };
+
+        Image<ValueType> acquire () {
+          std::lock_guard<std::mutex> guard (mutex);
+          if (buffers.empty()) {
+            Image<ValueType> buffer = Image<ValueType>::scratch(H, "temporary buffer");
+            if (init != ValueType(0))
+              std::fill_n(buffer.address(), voxel_count(buffer), init);
+            return buffer;
+          }
+          Image<ValueType> buffer = buffers.back();
+          buffers.pop_back();
+          buffer.reset();
+          return buffer;
+        }
+
+        void release (const Image<ValueType>& buffer) {
+          std::lock_guard<std::mutex> guard (mutex);
+          if (scopes)
+            buffers.push_back(buffer);
+        }
+
+        //! one lock per voxel
+        std::shared_ptr<RowLocks> locks () {
+          std::lock_guard<std::mutex> guard (mutex);
+          if (lock)
+            return lock;
+          std::shared_ptr<RowLocks> l = std::make_shared<RowLocks> (voxel_count(H));
+          if (scopes)
+            lock = l;
+          return l;
+        }
+
+      private:
+        const Header H;
+        const ValueType init;
+        vector<Image<ValueType>> buffers;
+        std::shared_ptr<RowLocks> lock;
+        size_t scopes;
+        std::mutex mutex;
+
+        void open () {
+          std::lock_guard<std::mutex> guard (mutex);
+          scopes++;
+        }
+
+        void close () {
+          std::lock_guard<std::mutex> guard (mutex);
+          if (--scopes == 0) {
+            buffers.clear();
+            lock.reset();
+          }
+        }
+    };
+
+
     template <class ImageType>
     class ReadCache : public Adapter::Base<ReadCache<ImageType>, ImageType>
     {
@@ -37,17 +165,30 @@ namespace MR
 
         using base_type::parent;
 
-        ReadCache (const ImageType& parent)
-          : base_type (parent)
+        ReadCache (const ImageType& parent, BufferPool<value_type>* pool = nullptr)
+          : base_type (parent), pool (pool)
         {
-          Header hdr (parent);
-          buffer = Image<value_type>::scratch(hdr, "temporary buffer");
+          if (pool) {
+            buffer = pool->acquire();
+          } else {
+            Header hdr (parent);
+            buffer = Image<value_type>::scratch(hdr, "temporary buffer");
+            std::fill_n(buffer.address(), voxel_count(buffer), value_type(NAN));
+          }
+          clear_region();
         }
 
         ReadCache (const ReadCache& other)
-          : ReadCache (other.parent())
+          : ReadCache (other.parent(), other.pool)
         { }
 
+        ~ReadCache () {
+          if (pool) {
+            flush();
+            pool->release(buffer);
+          }
+        }
+
         FORCE_INLINE ssize_t get_index (size_t axis) const {
           return buffer.get_index(axis);
         }
@@ -59,9 +200,20 @@ namespace MR
         }
 
         void flush () {
-          // clear buffer
+          // clear the region loaded since the last flush, which is bounded by the
+          // footprint of the current slice group rather than the whole volume
+          if (lo[0] <= hi[0]) {
+            for (ssize_t z = lo[2]; z <= hi[2]; z++) {
+              buffer.index(2) = z;
+              for (ssize_t y = lo[1]; y <= hi[1]; y++) {
+                buffer.index(1) = y;
+                for (buffer.index(0) = lo[0]; buffer.index(0) <= hi[0]; buffer.index(0)++)
+                  *buffer.address() = value_type(NAN);
+              }
+            }
+          }
+          clear_region();
           reset();
-          std::fill_n(buffer.address(), voxel_count(buffer), value_type(NAN));
         }
 
         FORCE_INLINE value_type value () {
@@ -77,10 +229,23 @@ namespace MR
 
       private:
         Image<value_type> buffer;
+        BufferPool<value_type>* pool;
+        ssize_t lo[3], hi[3];   // bounding box of the loaded voxels
 
         FORCE_INLINE void load (value_type& val) {
           assign_pos_of (buffer).to (parent());
           *buffer.address() = val = parent().value();
+          for (size_t k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], buffer.get_index(k));
+            hi[k] = std::max(hi[k], buffer.get_index(k));
+          }
+        }
+
+        FORCE_INLINE void clear_region () {
+          for (size_t k = 0; k < 3; k++) {
+            lo[k] = buffer.size(k);
+            hi[k] = -1;
+          }
         }
     };
 
@@ -94,21 +259,37 @@ namespace MR
 
         using base_type::parent;
 
-        WriteCache (const ImageType& parent)
-          : base_type (parent)
+        WriteCache (const ImageType& parent, BufferPool<value_type>* pool = nullptr)
+          : base_type (parent), pool (pool)
         {
-          Header hdr (parent);
-          buffer = Image<value_type>::scratch(hdr, "temporary buffer");
-          // initialise lock image
-          static_assert (sizeof(std::atomic_flag) == sizeof(uint8_t), "std::atomic_flag expected to be 1 byte");
-          lock = Image<uint8_t>::scratch(hdr, "temporary buffer lock");
+          if (pool) {
+            buffer = pool->acquire();
+            lock = pool->locks();
+          } else {
+            Header hdr (parent);
+            buffer = Image<value_type>::scratch(hdr, "temporary buffer");
+            lock = std::make_shared<RowLocks> (voxel_count(hdr));
+          }
+          clear_region();
         }
 
         WriteCache (const WriteCache& other)
-          : base_type (other.parent()), lock (other.lock)
+          : base_type (other.parent()), lock (other.lock), pool (other.pool)
         {
-          Header hdr (other.parent());
-          buffer = Image<value_type>::scratch(hdr, "temporary buffer");
+          if (pool) {
+            buffer = pool->acquire();
+          } else {
+            Header hdr (other.parent());
+            buffer = Image<value_type>::scratch(hdr, "temporary buffer");
+          }
+          clear_region();
+        }
+
+        ~WriteCache () {
+          if (pool) {
+            flush();
+            pool->release(buffer);
+          }
         }
 
         FORCE_INLINE ssize_t get_index (size_t axis) const {
@@ -122,22 +303,32 @@ namespace MR
         }
 
         void flush () {
-          // delayed write back
-          for (auto l = Loop() (buffer); l; l++) {
-            if (buffer.value()) { assign_pos_of (buffer).to (parent(), lock);
-              std::atomic_flag* flag = reinterpret_cast<std::atomic_flag*> (lock.address());
-              while (flag->test_and_set(std::memory_order_acquire)) ;
-              parent().adjoint_add(buffer.value());
-              flag->clear(std::memory_order_release);
+          // delayed write back and clear, restricted to the region written since the last flush
+          if (lo[0] <= hi[0]) {
+            for (ssize_t z = lo[2]; z <= hi[2]; z++) {
+              buffer.index(2) = z;
+              for (ssize_t y = lo[1]; y <= hi[1]; y++) {
+                buffer.index(1) = y;
+                for (buffer.index(0) = lo[0]; buffer.index(0) <= hi[0]; buffer.index(0)++) {
+                  if (buffer.value()) { assign_pos_of (buffer).to (parent());
+                    RowLock guard (*lock, (z*buffer.size(1) + y)*buffer.size(0) + buffer.index(0));
+                    parent().adjoint_add(buffer.value());
+                    buffer.value() = value_type(0);
+                  }
+                }
+              }
             }
           }
-          // clear buffer
+          clear_region();
           reset();
-          std::fill_n(buffer.address(), voxel_count(buffer), value_type(0));
         }
 
         FORCE_INLINE void adjoint_add (value_type val) {
           *buffer.address() += val;
+          for (size_t k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], buffer.get_index(k));
+            hi[k] = std::max(hi[k], buffer.get_index(k));
+          }
         }
 
         FORCE_INLINE void set_shotidx (size_t idx) {
@@ -147,7 +338,16 @@ namespace MR
 
       private:
         Image<value_type> buffer;
-        Image<uint8_t> lock;
+        std::shared_ptr<RowLocks> lock;
+        BufferPool<value_type>* pool;
+        ssize_t lo[3], hi[3];   // bounding box of the written voxels
+
+        FORCE_INLINE void clear_region () {
+          for (size_t k = 0; k < 3; k++) {
+            lo[k] = buffer.size(k);
+            hi[k] = -1;
+          }
+        }
     };
 
     template <template <class ImageType> class AdapterType, class ImageType, typename... Args>
@@ -160,6 +360,18 @@ namespace MR
       return { { parent, std::forward<Args> (args)... } };
     }
 
+    template <template <class ImageType> class AdapterType, class ImageType, typename... Args>
+    inline ReadCache<AdapterType<ImageType>> makepooled (BufferPool<typename ImageType::value_type>& pool,
+                                                         const ImageType& parent, Args&&... args) {
+      return { { parent, std::forward<Args> (args)... }, &pool };
+    }
+
+    template <template <class ImageType> class AdapterType, class ImageType, typename... Args>
+    inline WriteCache<AdapterType<ImageType>> makepooled_add (BufferPool<typename ImageType::value_type>& pool,
+                                                              const ImageType& parent, Args&&... args) {
+      return { { parent, std::forward<Args> (args)... }, &pool };
+    }
+
   }
 
   namespace DWI
@@ -287,52 +499,67 @@ namespace MR
       };
 
 
-      template <class ImageType>
-      class QSpaceMapping : public Adapter::Base<QSpaceMapping<ImageType>, ImageType>
+      /**
+       *  Adapter that contracts the coefficients of a recon image with the q-space projection
+       *  of a shot. QSpace<N>::Mapping is specialised for a fixed no. coefficients N, so that
+       *  the dot and axpy over the coefficients unroll into registers; QSpaceMapping is the
+       *  dynamic-size version. Both can be passed as template template arguments to the
+       *  Adapter factories.
+       */
+      template <int N>
+      struct QSpace
       {
-        MEMALIGN (QSpaceMapping<ImageType>)
-        public:
-          using base_type = Adapter::Base<QSpaceMapping<ImageType>, ImageType>;
-          using value_type = typename ImageType::value_type;
-          using vector_type = typename Eigen::Matrix<value_type, Eigen::Dynamic, 1>;
-
-          using base_type::parent;
-
-          QSpaceMapping (const ImageType& parent, const QSpaceBasis& basis)
-            : base_type (parent), basis (basis)
-          {
-            assert (parent.ndim() == 4);
-            assert (parent.size(3) == basis.get_ncoefs());
-            assert (parent.stride(3) == 1);
-            set_shotidx(0);
-          }
+        template <class ImageType>
+        class Mapping : public Adapter::Base<Mapping<ImageType>, ImageType>
+        {
+          MEMALIGN (Mapping<ImageType>)
+          public:
+            using base_type = Adapter::Base<Mapping<ImageType>, ImageType>;
+            using value_type = typename ImageType::value_type;
+            using vector_type = Eigen::Matrix<value_type, N, 1, Eigen::DontAlign>;
+
+            using base_type::parent;
+
+            Mapping (const ImageType& parent, const QSpaceBasis& basis)
+              : base_type (parent), basis (basis)
+            {
+              assert (parent.ndim() == 4);
+              assert (parent.size(3) == basis.get_ncoefs());
+              assert (parent.stride(3) == 1);
+              assert (N == Eigen::Dynamic || N == basis.get_ncoefs());
+              set_shotidx(0);
+            }
 
-          FORCE_INLINE size_t ndim () const { return 3; }
+            FORCE_INLINE size_t ndim () const { return 3; }
 
-          FORCE_INLINE ssize_t get_index (size_t axis) const { return parent().get_index (axis); }
-          FORCE_INLINE void move_index (size_t axis, ssize_t increment) { parent().move_index (axis, increment); }
+            FORCE_INLINE ssize_t get_index (size_t axis) const { return parent().get_index (axis); }
+            FORCE_INLINE void move_index (size_t axis, ssize_t increment) { parent().move_index (axis, increment); }
 
-          FORCE_INLINE value_type value () const {
-            assert (parent().index(3) == 0);
-            Eigen::Map<vector_type> c = {parent().address(), qr.size()};
-            return qr.dot(c);
-          }
+            FORCE_INLINE value_type value () const {
+              assert (parent().index(3) == 0);
+              Eigen::Map<vector_type> c = {parent().address(), qr.size()};
+              return qr.dot(c);
+            }
 
-          FORCE_INLINE void adjoint_add (value_type val) {
-            assert (parent().index(3) == 0);
-            Eigen::Map<vector_type> c = {parent().address(), qr.size()};
-            c += val * qr;
-          }
+            FORCE_INLINE void adjoint_add (value_type val) {
+              assert (parent().index(3) == 0);
+              Eigen::Map<vector_type> c = {parent().address(), qr.size()};
+              c += val * qr;
+            }
 
-          FORCE_INLINE void set_shotidx (size_t idx) {
-            qr = basis.get_projection(idx);
-          }
+            FORCE_INLINE void set_shotidx (size_t idx) {
+              qr = basis.get_projection(idx);
+            }
 
-        private:
-          const QSpaceBasis& basis;
-          vector_type qr;
+          private:
+            const QSpaceBasis& basis;
+            vector_type qr;
+        };
       };
 
+      template <class ImageType>
+      using QSpaceMapping = QSpace<Eigen::Dynamic>::Mapping<ImageType>;
+
 
     }
   }
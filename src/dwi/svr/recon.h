@@ -15,6 +15,7 @@
 
 #include "types.h"
 #include "image.h"
+#include "algo/threaded_loop.h"
 
 #include "dwi/svr/mapping.h"
 
@@ -80,6 +81,7 @@ namespace MR
     namespace SVR {
       class ReconMatrix;
       class ReconMatrixAdjoint;
+      class ReconMatrixNormal;
     }
   }
 }
@@ -95,6 +97,10 @@ namespace Eigen {
     template<>
     struct traits<MR::DWI::SVR::ReconMatrixAdjoint> : public Eigen::internal::traits<Eigen::SparseMatrix<float,Eigen::ColMajor> >
     {};
+
+    template<>
+    struct traits<MR::DWI::SVR::ReconMatrixNormal> : public Eigen::internal::traits<Eigen::SparseMatrix<float,Eigen::ColMajor> >
+    {};
   }
 }
 
@@ -127,7 +133,6 @@ namespace MR
         return Eigen::Product<ReconMatrix,Rhs,Eigen::AliasFreeProduct>(*this, x.derived());
       }
 
-      typedef Eigen::SparseMatrix<float, Eigen::RowMajor, StorageIndex> SparseMat;
       typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXf;
 
       // Custom API:
@@ -143,13 +148,94 @@ namespace MR
         init_zreg(scale*zreg);
       }
 
+      /**
+       * Rediscretise a reconstruction matrix on a recon grid that is 2x coarser, for use in
+       * multigrid. The slice weights are shared. The regularisers are rescaled so that they
+       * approximate the fine-grid regularisation of a piecewise constant prolongation:
+       * a difference operator of order p shrinks by 2^-p per fine voxel, and each coarse
+       * voxel covers 8 fine voxels.
+       */
+      ReconMatrix(const ReconMapping& coarse, const ReconMatrix& fine)
+        : map (coarse), W (fine.W), Wvox (fine.Wvox),
+          DL (fine.DL * (std::sqrt(8.0f) / 4.0f)),
+          DZ (fine.DZ * (std::sqrt(8.0f) / 256.0f))
+      { }
+
       ReconMatrixAdjoint adjoint() const;
+      ReconMatrixNormal normal() const;
 
       const Eigen::MatrixXf& getWeights() const        { return W; }
       void setWeights (const Eigen::MatrixXf& weights) { W = weights; }
 
+      const Eigen::VectorXf& getVoxelWeights() const  { return Wvox; }
       void setVoxelWeights(const Eigen::VectorXf& weights) { Wvox = weights; }
 
+      const ReconMapping& mapping() const { return map; }
+
+      // dst += (L^T L + Z^T Z) * rhs
+      void regularisers_normal_add(Eigen::Ref<Eigen::VectorXf> dst, const Eigen::Ref<const Eigen::VectorXf>& rhs) const
+      {
+        size_t nxyz = map.xheader().size(0)*map.xheader().size(1)*map.xheader().size(2);
+        size_t nc = map.xheader().size(3);
+        Eigen::Map<RowMatrixXf> X (dst.data(), nxyz, nc);
+        Eigen::Map<const RowMatrixXf> Xin (rhs.data(), nxyz, nc);
+        regularisers_normal_add(X, Xin);
+      }
+
+      // X += (L^T L + Z^T Z) * Xin, for any number of coefficient images side by side
+      void regularisers_normal_add(Eigen::Map<RowMatrixXf>& X, const Eigen::Map<const RowMatrixXf>& Xin) const
+      {
+        RowMatrixXf tmp (Xin.rows(), Xin.cols());
+        Eigen::Map<RowMatrixXf> T (tmp.data(), tmp.rows(), tmp.cols());
+        Eigen::Map<const RowMatrixXf> Tc (tmp.data(), tmp.rows(), tmp.cols());
+        tmp.setZero();
+        laplacian_add(T, Xin);
+        laplacian_add(X, Tc);
+        tmp.setZero();
+        zreg_add(T, Xin);
+        zreg_adjoint_add(X, Tc);
+      }
+
+      /**
+       * Y += (R^T W_k R + L^T L + Z^T Z) X for k recon images side by side (nxyz x k*ncoefs),
+       * which share the slice weights but have their own voxel weights Wvox (nsrc x k).
+       */
+      void normal_multi_add(RowMatrixXf& Y, const RowMatrixXf& X, const RowMatrixXf& Wvox) const
+      {
+        map.x2x_multi(Y, X, W, Wvox);
+        Eigen::Map<RowMatrixXf> Ym (Y.data(), Y.rows(), Y.cols());
+        Eigen::Map<const RowMatrixXf> Xm (X.data(), X.rows(), X.cols());
+        regularisers_normal_add(Ym, Xm);
+      }
+
+      // dst += diag(L^T L + Z^T Z), i.e., the squared column norms of both regularisers
+      void regularisers_diagonal_add(Eigen::Ref<Eigen::VectorXf> dst) const
+      {
+        const ssize_t nx = map.xheader().size(0), ny = map.xheader().size(1), nz = map.xheader().size(2);
+        const size_t nc = map.xheader().size(3);
+        // Z acts along z only; build its nz x nz matrix, including the clamped boundaries.
+        Eigen::MatrixXf Zm (nz, nz); Zm.setZero();
+        for (ssize_t z = 0; z < nz; z++) {
+          Zm(z,z) += DZ[0];
+          for (ssize_t k = 1; k < DZ.size(); k++) {
+            Zm(z, (z > k-1) ? z-k : 0) += DZ[k];
+            Zm(z, (z < nz-k) ? z+k : nz-1) += DZ[k];
+          }
+        }
+        Eigen::VectorXf zdiag = Zm.colwise().squaredNorm();
+        // L: clamped neighbours fold onto the centre voxel
+        size_t j = 0;
+        for (ssize_t z = 0; z < nz; z++) {
+          for (ssize_t y = 0; y < ny; y++) {
+            for (ssize_t x = 0; x < nx; x++, j++) {
+              int nb = (x == 0) + (x == nx-1) + (y == 0) + (y == ny-1) + (z == 0) + (z == nz-1);
+              Scalar c = DL[0] + nb * DL[1];
+              dst.segment(j*nc, nc).array() += c*c + (6-nb) * DL[1]*DL[1] + zdiag[z];
+            }
+          }
+        }
+      }
+
       template <typename VectorType1, typename VectorType2>
       void project(VectorType1& dst, const VectorType2& rhs, bool useweights = true) const
       {
@@ -169,10 +255,10 @@ namespace MR
         Eigen::Map<const RowMatrixXf> X (rhs.data(), nxyz, nc);
         Eigen::Ref<Eigen::VectorXf> ref1 = dst.segment(map.rows(), map.cols());
         Eigen::Map<RowMatrixXf> Yreg1 (ref1.data(), nxyz, nc);
-        Yreg1.noalias() += L * X;
+        laplacian_add(Yreg1, X);
         Eigen::Ref<Eigen::VectorXf> ref2 = dst.segment(map.rows()+map.cols(), map.cols());
         Eigen::Map<RowMatrixXf> Yreg2 (ref2.data(), nxyz, nc);
-        Yreg2.noalias() += Z * X;
+        zreg_add(Yreg2, X);
       }
 
 
@@ -180,80 +266,113 @@ namespace MR
       const ReconMapping& map;
       Eigen::MatrixXf W;
       Eigen::VectorXf Wvox;
-      SparseMat L, Z;
+      Eigen::Matrix<Scalar, 2, 1> DL;   // Laplacian stencil: centre, neighbours
+      Eigen::Matrix<Scalar, 5, 1> DZ;   // slice stencil: centre, +-1, ..., +-4
 
       void init_laplacian(const float lambda)
       {
         DEBUG("Initialising Laplacian regularizer.");
         // Regularization convolution filter set as Laplacian filter.
-        Eigen::Matrix<Scalar, 2, 1> D;
-        D << -6, 1;
-        D *= lambda;
-
-        size_t nx = map.xheader().size(0);
-        size_t ny = map.xheader().size(1);
-        size_t nz = map.xheader().size(2);
-        size_t nxy = nx*ny, nxyz = nxy*nz;
-        auto get_idx = [&] (size_t x, size_t y, size_t z) { return z*nxy + y*nx + x; };
-
-        L.resize(nxyz, nxyz);
-        L.reserve(Eigen::VectorXi::Constant(nxyz, 7));
-        for (size_t z = 0; z < nz; z++) {
-          for (size_t y = 0; y < ny; y++) {
-            for (size_t x = 0; x < nx; x++) {
-              L.coeffRef(get_idx(x, y, z), get_idx(x, y, z)) += D[0];
-
-              L.coeffRef(get_idx(x, y, z), get_idx(x, y, (z) ? z-1 : 0)) += D[1];
-              L.coeffRef(get_idx(x, y, z), get_idx(x, (y) ? y-1 : 0, z)) += D[1];
-              L.coeffRef(get_idx(x, y, z), get_idx((x) ? x-1 : 0, y, z)) += D[1];
-              L.coeffRef(get_idx(x, y, z), get_idx((x < nx-1) ? x+1 : nx-1, y, z)) += D[1];
-              L.coeffRef(get_idx(x, y, z), get_idx(x, (y < ny-1) ? y+1 : ny-1, z)) += D[1];
-              L.coeffRef(get_idx(x, y, z), get_idx(x, y, (z < nz-1) ? z+1 : nz-1)) += D[1];
-
-            }
-          }
-        }
-        L.makeCompressed();
+        DL << -6, 1;
+        DL *= lambda;
       }
 
       void init_zreg(const float lambda)
       {
         DEBUG("Initialising slice regularizer.");
-        Eigen::Matrix<Scalar, 5, 1> D;
-        D << 70, -56, 28, -8, 1;
-        D *= lambda;
-
-        size_t nx = map.xheader().size(0);
-        size_t ny = map.xheader().size(1);
-        size_t nz = map.xheader().size(2);
-        size_t nxy = nx*ny, nxyz = nxy*nz;
-        auto get_idx = [&] (size_t x, size_t y, size_t z) { return z*nxy + y*nx + x; };
-
-        Z.resize(nxyz, nxyz);
-        Z.reserve(Eigen::VectorXi::Constant(nxyz, 9));
-        for (size_t z = 0; z < nz; z++) {
-          for (size_t y = 0; y < ny; y++) {
-            for (size_t x = 0; x < nx; x++) {
-              Z.coeffRef(get_idx(x, y, z), get_idx(x, y, z)) += D[0];
-
-              Z.coeffRef(get_idx(x, y, z), get_idx(x, y, (z) ? z-1 : 0)) += D[1];
-              Z.coeffRef(get_idx(x, y, z), get_idx(x, y, (z < nz-1) ? z+1 : nz-1)) += D[1];
-
-              Z.coeffRef(get_idx(x, y, z), get_idx(x, y, (z > 1) ? z-2 : 0)) += D[2];
-              Z.coeffRef(get_idx(x, y, z), get_idx(x, y, (z < nz-2) ? z+2 : nz-1)) += D[2];
-
-              Z.coeffRef(get_idx(x, y, z), get_idx(x, y, (z > 2) ? z-3 : 0)) += D[3];
-              Z.coeffRef(get_idx(x, y, z), get_idx(x, y, (z < nz-3) ? z+3 : nz-1)) += D[3];
-
-              Z.coeffRef(get_idx(x, y, z), get_idx(x, y, (z > 3) ? z-4 : 0)) += D[4];
-              Z.coeffRef(get_idx(x, y, z), get_idx(x, y, (z < nz-4) ? z+4 : nz-1)) += D[4];
+        DZ << 70, -56, 28, -8, 1;
+        DZ *= lambda;
+      }
+
+      /* The regularisers are applied matrix-free, directly on the coefficient-contiguous
+       * recon vector. Each row of nc coefficients is contiguous, and so is each line of
+       * nx voxels along x, which makes every stencil tap a vectorised axpy over nx*nc
+       * values. Boundaries are clamped, as in the equivalent sparse matrices. */
+
+      struct LaplacianStencil {   MEMALIGN(LaplacianStencil);
+        Eigen::Map<RowMatrixXf> Y;
+        Eigen::Map<const RowMatrixXf> X;
+        const ssize_t nx, ny, nz;
+        const Scalar c, n;
+
+        FORCE_INLINE ssize_t line (ssize_t y, ssize_t z) const { return (z*ny + y)*nx; }
+
+        void operator() (Iterator& pos) {
+          const ssize_t y = pos.index(1), z = pos.index(2);
+          const ssize_t i = line(y, z);
+          auto out = Y.middleRows(i, nx);
+          out += c * X.middleRows(i, nx);
+          out += n * X.middleRows(line((y) ? y-1 : 0, z), nx);
+          out += n * X.middleRows(line((y < ny-1) ? y+1 : ny-1, z), nx);
+          out += n * X.middleRows(line(y, (z) ? z-1 : 0), nx);
+          out += n * X.middleRows(line(y, (z < nz-1) ? z+1 : nz-1), nx);
+          // neighbours along x, shifted in memory and clamped at both ends
+          out.topRows(nx-1) += n * X.middleRows(i+1, nx-1);
+          out.bottomRows(nx-1) += n * X.middleRows(i, nx-1);
+          out.row(0) += n * X.row(i);
+          out.row(nx-1) += n * X.row(i+nx-1);
+        }
+      };
+
+      struct SliceStencil {   MEMALIGN(SliceStencil);
+        Eigen::Map<RowMatrixXf> Y;
+        Eigen::Map<const RowMatrixXf> X;
+        const ssize_t nx, ny, nz;
+        const Eigen::Matrix<Scalar, 5, 1> D;
+        const bool transpose;
+
+        FORCE_INLINE ssize_t line (ssize_t y, ssize_t z) const { return (z*ny + y)*nx; }
+
+        // process one xz-plane, so that the transpose can scatter along z without races
+        void operator() (Iterator& pos) {
+          const ssize_t y = pos.index(1);
+          for (ssize_t z = 0; z < nz; z++) {
+            const ssize_t i = line(y, z);
+            if (transpose) {
+              auto in = X.middleRows(i, nx);
+              Y.middleRows(i, nx) += D[0] * in;
+              for (ssize_t k = 1; k < D.size(); k++) {
+                Y.middleRows(line(y, (z > k-1) ? z-k : 0), nx) += D[k] * in;
+                Y.middleRows(line(y, (z < nz-k) ? z+k : nz-1), nx) += D[k] * in;
+              }
+            } else {
+              auto out = Y.middleRows(i, nx);
+              out += D[0] * X.middleRows(i, nx);
+              for (ssize_t k = 1; k < D.size(); k++) {
+                out += D[k] * X.middleRows(line(y, (z > k-1) ? z-k : 0), nx);
+                out += D[k] * X.middleRows(line(y, (z < nz-k) ? z+k : nz-1), nx);
+              }
             }
           }
         }
-        Z.makeCompressed();
+      };
+
+      // Y += L * X  (L is symmetric)
+      void laplacian_add(Eigen::Map<RowMatrixXf>& Y, const Eigen::Map<const RowMatrixXf>& X) const
+      {
+        const Header& hdr = map.xheader();
+        LaplacianStencil func = {Y, X, hdr.size(0), hdr.size(1), hdr.size(2), DL[0], DL[1]};
+        ThreadedLoop (hdr, vector<size_t>({1, 2}), vector<size_t>({0})).run_outer (func);
+      }
+
+      // Y += Z * X
+      void zreg_add(Eigen::Map<RowMatrixXf>& Y, const Eigen::Map<const RowMatrixXf>& X) const
+      {
+        const Header& hdr = map.xheader();
+        SliceStencil func = {Y, X, hdr.size(0), hdr.size(1), hdr.size(2), DZ, false};
+        ThreadedLoop (hdr, vector<size_t>({1}), vector<size_t>({0, 2})).run_outer (func);
+      }
+
+      // Y += Z^T * X
+      void zreg_adjoint_add(Eigen::Map<RowMatrixXf>& Y, const Eigen::Map<const RowMatrixXf>& X) const
+      {
+        const Header& hdr = map.xheader();
+        SliceStencil func = {Y, X, hdr.size(0), hdr.size(1), hdr.size(2), DZ, true};
+        ThreadedLoop (hdr, vector<size_t>({1}), vector<size_t>({0, 2})).run_outer (func);
       }
 
       friend class ReconMatrixAdjoint;
+      friend class ReconMatrixNormal;
     };
 
 
@@ -307,10 +426,10 @@ namespace MR
         Eigen::Map<RowMatrixXf> X (dst.data(), nxyz, nc);
         Eigen::Ref<const Eigen::VectorXf> ref1 = rhs.segment(map.rows(), map.cols());
         Eigen::Map<const RowMatrixXf> Yreg1 (ref1.data(), nxyz, nc);
-        X.noalias() += recmat.L.adjoint() * Yreg1;
+        recmat.laplacian_add(X, Yreg1);
         Eigen::Ref<const Eigen::VectorXf> ref2 = rhs.segment(map.rows()+map.cols(), map.cols());
         Eigen::Map<const RowMatrixXf> Yreg2 (ref2.data(), nxyz, nc);
-        X.noalias() += recmat.Z.adjoint() * Yreg2;
+        recmat.zreg_adjoint_add(X, Yreg2);
       }
 
     private:
@@ -325,6 +444,77 @@ namespace MR
     }
 
 
+
+    /**
+     *  Normal matrix R^T R of the weighted and regularised reconstruction matrix, for use
+     *  with Eigen::ConjugateGradient. The data term is applied in one fused pass over all
+     *  source slices, which avoids the full-length residual of the least-squares solver.
+     *  The fused pass writes back under locks, so with a lock-free reduction (see
+     *  ReconMapping::set_reduction()) the data term is applied as a forward and a
+     *  transpose projection instead, through a weighted prediction of all source voxels.
+     */
+    class ReconMatrixNormal : public Eigen::EigenBase<ReconMatrixNormal>
+    {  MEMALIGN(ReconMatrixNormal);
+    public:
+      // Required typedefs, constants, and method:
+      typedef float Scalar;
+      typedef float RealScalar;
+      typedef int StorageIndex;
+      enum {
+        ColsAtCompileTime = Eigen::Dynamic,
+        MaxColsAtCompileTime = Eigen::Dynamic,
+        IsRowMajor = false
+      };
+
+      Eigen::Index rows() const { return recmat.cols(); }
+      Eigen::Index cols() const { return recmat.cols(); }
+
+      template<typename Rhs>
+      Eigen::Product<ReconMatrixNormal,Rhs,Eigen::AliasFreeProduct> operator*(const Eigen::MatrixBase<Rhs>& x) const {
+        return Eigen::Product<ReconMatrixNormal,Rhs,Eigen::AliasFreeProduct>(*this, x.derived());
+      }
+
+      // Custom API:
+      ReconMatrixNormal(const ReconMatrix& m)
+        : recmat (m), map (m.map)
+      { }
+
+      const ReconMatrix& matrix() const { return recmat; }
+
+      template <typename VectorType1, typename VectorType2>
+      void project(VectorType1& dst, const VectorType2& rhs) const
+      {
+        INFO("Normal projection.");
+        Eigen::VectorXf copy = rhs;
+        ImageView<float> recon (map.xheader(), dst.data());
+        ImageView<float> recin (map.xheader(), copy.data());
+        if (map.lockfree()) {
+          Eigen::VectorXf pred (map.rows()); pred.setZero();
+          ImageView<float> source (map.yheader(), pred.data());
+          map.x2y(recin, source);
+          size_t j = 0;
+          for (auto l = Loop() (source); l; l++, j++)
+            source.value() *= recmat.W((size_t) source.index(2), (size_t) source.index(3)) * recmat.Wvox[j];
+          map.y2x(recon, source);
+        } else {
+          map.x2x(recon, recin, recmat.W, recmat.Wvox);
+        }
+        INFO("Normal projection - regularisers");
+        recmat.regularisers_normal_add(dst, copy);
+      }
+
+    private:
+      const ReconMatrix& recmat;
+      const ReconMapping& map;
+
+    };
+
+    ReconMatrixNormal ReconMatrix::normal() const
+    {
+      return ReconMatrixNormal(*this);
+    }
+
+
     }
   }
 }
@@ -368,6 +558,23 @@ namespace Eigen {
       }
     };
 
+    template<typename Rhs>
+    struct generic_product_impl<MR::DWI::SVR::ReconMatrixNormal, Rhs, SparseShape, DenseShape, GemvProduct>
+      : generic_product_impl_base<MR::DWI::SVR::ReconMatrixNormal,Rhs,generic_product_impl<MR::DWI::SVR::ReconMatrixNormal,Rhs> >
+    {
+      typedef typename Product<MR::DWI::SVR::ReconMatrixNormal,Rhs>::Scalar Scalar;
+
+      template<typename Dest>
+      static void scaleAndAddTo(Dest& dst, const MR::DWI::SVR::ReconMatrixNormal& lhs, const Rhs& rhs, const Scalar& alpha)
+      {
+        // This method should implement "dst += alpha * lhs * rhs" inplace
+        assert(alpha==Scalar(1) && "scaling is not implemented");
+
+        lhs.project<Dest, Rhs>(dst, rhs);
+
+      }
+    };
+
   }
 }
 
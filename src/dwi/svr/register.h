@@ -31,13 +31,15 @@ namespace MR
     namespace SVR
     {
 
-      /* Register prediction to slices. */
+      /* Register prediction to slices. The SSP is an SSP<float>, or a FixedSSP for common
+       * sizes (see TapSSP), with the loops over its taps unrolled. */
+      template <class SSPType = SSP<float>>
       class SliceRegistrationFunctor : public Eigen::DenseFunctor<float>
-      {  MEMALIGN(SliceRegistrationFunctor);
+      {  MEMALIGN(SliceRegistrationFunctor<SSPType>);
       public:
       
         SliceRegistrationFunctor(const Image<Scalar>& target, const Image<Scalar>& moving, 
-                                 const Image<bool>& mask, const size_t mb, const SSP<float>& ssp,
+                                 const Image<bool>& mask, const size_t mb, const SSPType& ssp,
                                  const size_t v, const size_t e)
           : m (0), nexc ((mb) ? target.size(2)/mb : 1), vol (v), exc (e), T0 (target),
             ssp (ssp), mask (mask), target (target),
@@ -116,7 +118,7 @@ namespace MR
       private:
         size_t m, nexc, vol, exc;
         Transform T0;
-        const SSP<float> ssp;
+        const SSPType ssp;
         Image<bool> mask;
         Image<Scalar> target;
         Interp::SplineInterp<Image<Scalar>, Math::HermiteSpline<Scalar>, Math::SplineProcessingType::Value> moving;
@@ -269,14 +271,7 @@ namespace MR
             copy(reslicer, mask_t);
           }
           // register prediction to data
-          SliceRegistrationFunctor func (data, pred, mask_t, mb, ssp, slice.vol, slice.exc);
-          Eigen::LevenbergMarquardt<SliceRegistrationFunctor> lm (func);
-          if (maxiter > 0)
-            lm.setMaxfev(maxiter);
-          Eigen::VectorXf x = slice.motion.transpose();
-          lm.minimize(x);
-          if (lm.info() == Eigen::ComputationInfo::Success || lm.info() == Eigen::ComputationInfo::NoConvergence)
-            out.motion = x.head<6>().transpose();
+          SpecialiseTaps::run (ssp.size(), Align {*this, slice, out});
           return true;
         }
 
@@ -289,6 +284,26 @@ namespace MR
         const size_t mb, maxiter;
         const int lmax;
         const SSP<float> ssp;
+
+        struct Align {   NOMEMALIGN
+          SliceAlignPipe& pipe;
+          const SliceIdx& slice;
+          SliceIdx& out;
+          template <int H> void run () { const TapSSP<H>& sp = pipe.ssp; pipe.align(sp, slice, out); }
+        };
+
+        template <class SSPType>
+        void align (const SSPType& s, const SliceIdx& slice, SliceIdx& out)
+        {
+          SliceRegistrationFunctor<SSPType> func (data, pred, mask_t, mb, s, slice.vol, slice.exc);
+          Eigen::LevenbergMarquardt<SliceRegistrationFunctor<SSPType>> lm (func);
+          if (maxiter > 0)
+            lm.setMaxfev(maxiter);
+          Eigen::VectorXf x = slice.motion.transpose();
+          lm.minimize(x);
+          if (lm.info() == Eigen::ComputationInfo::Success || lm.info() == Eigen::ComputationInfo::NoConvergence)
+            out.motion = x.head<6>().transpose();
+        }
       
       };
 
@@ -0,0 +1,477 @@
+/* Copyright (c) 2017-2019 Daan Christiaens
+ *
+ * MRtrix and this add-on module are distributed in the hope
+ * that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __dwi_svr_solver_h__
+#define __dwi_svr_solver_h__
+
+
+#include <atomic>
+#include <mutex>
+#include <Eigen/Dense>
+
+#include "types.h"
+#include "thread.h"
+
+#include "dwi/svr/recon.h"
+
+#define SWEEP_BLOCK 65536
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace SVR
+    {
+
+    /**
+     *  Run kernel(begin, end, sums) over contiguous blocks of [0, n) on all threads, and
+     *  return the total of the N partial sums that the kernel accumulates. For
+     *  N = Eigen::Dynamic, nsums gives the no. partial sums.
+     */
+    template <int N, class Kernel>
+    Eigen::Matrix<double, N, 1> parallel_sweep (const size_t n, const Kernel& kernel, const size_t nsums = N)
+    {
+      using Sums = Eigen::Matrix<double, N, 1>;
+      std::atomic<size_t> next (0);
+      std::mutex mutex;
+      Sums total = Sums::Zero(nsums);
+      struct Worker {   MEMALIGN(Worker);
+        const Kernel& kernel;
+        std::atomic<size_t>& next;
+        std::mutex& mutex;
+        Sums& total;
+        const size_t n;
+        void execute () {
+          Sums sums = Sums::Zero(total.size());
+          size_t begin;
+          while ((begin = next.fetch_add(SWEEP_BLOCK)) < n)
+            kernel(begin, std::min(begin + SWEEP_BLOCK, n), sums);
+          std::lock_guard<std::mutex> lock (mutex);
+          total += sums;
+        }
+      } worker = {kernel, next, mutex, total, n};
+      Thread::run (Thread::multi (worker), "sweep");
+      return total;
+    }
+
+
+
+    /**
+     *  Matrix-free LSQR and LSMR solvers for the weighted and regularised ReconMatrix.
+     *
+     *  Unlike Eigen::LeastSquaresConjugateGradient, all vector updates of one iteration are
+     *  fused into a few threaded sweeps over preallocated buffers. The Lanczos vectors u and v
+     *  are stored unnormalised with a scale factor, so that normalisation is folded into the
+     *  next update rather than taking a pass of its own.
+     *
+     *  Convergence is declared when the normal residual |A^T r| drops below the tolerance,
+     *  relative to its initial value, or when the relative change of the solution within an
+     *  optional voxel mask drops below the step tolerance.
+     */
+    class LeastSquaresSolver
+    {  MEMALIGN(LeastSquaresSolver);
+    public:
+      enum Method { LSQR, LSMR };
+
+      LeastSquaresSolver (const ReconMatrix& R, const Method method = LSQR)
+        : R (R), method (method), nc (R.mapping().xheader().size(3)),
+          tol (1e-4), xtol (0.0), maxiter (10), iter (0), err (0.0)
+      {
+        mask.setOnes(R.cols() / nc);
+      }
+
+      void setTolerance (const float t)           { tol = t; }
+      void setStepTolerance (const float t)       { xtol = t; }
+      void setMaxIterations (const size_t n)      { maxiter = n; }
+      //! voxel mask (one entry per recon voxel) for the step tolerance
+      void setMask (const Eigen::VectorXf& m)     { assert(m.size() == mask.size()); mask = m; }
+
+      size_t iterations () const { return iter; }
+      double error () const { return err; }
+
+      Eigen::VectorXf solveWithGuess (const Eigen::VectorXf& b, const Eigen::VectorXf& x0)
+      {
+        const size_t m = R.rows(), n = R.cols();
+        x = x0;
+        u.resize(m); v.setZero(n); w.resize(n);
+        tmpm.setZero(m); tmpn.setZero(n);
+        if (method == LSMR) hbar.setZero(n);
+        iter = 0; err = 0.0;
+
+        // beta u = b - A x0,  alpha v = A^T u
+        R.project(tmpm, x);
+        double beta = std::sqrt(parallel_sweep<1>(m, [&](size_t i0, size_t i1, Eigen::Matrix<double,1,1>& s) {
+          for (size_t i = i0; i < i1; i++) {
+            u[i] = b[i] - tmpm[i];
+            tmpm[i] = 0.0f;
+            s[0] += double(u[i]) * u[i];
+          }
+        })[0]);
+        if (beta == 0.0) return x;
+        double su = 1.0 / beta;
+        double alpha = adjoint_step(0.0, su);
+        if (alpha == 0.0) return x;
+        double sv = su / alpha;
+        w = float(sv) * v;
+
+        // LSQR
+        double phibar = beta, rhobar = alpha;
+        // LSMR
+        double alphabar = alpha, zetabar = alpha*beta, rho = 1.0, rhobar1 = 1.0, cbar = 1.0, sbar = 0.0;
+        const double normAr0 = alpha*beta;
+
+        for (iter = 1; iter <= maxiter; iter++) {
+          // beta u = A v - alpha u
+          beta = forward_step(-alpha * su / sv, sv);
+          if (beta == 0.0) break;
+          su = sv / beta;
+          // alpha v = A^T u - beta v
+          alpha = adjoint_step(-beta * sv / su, su);
+          sv = (alpha > 0.0) ? su / alpha : 0.0;
+
+          double normAr;
+          Eigen::Matrix<double,2,1> change;
+          if (method == LSQR) {
+            double r = std::hypot(rhobar, beta);
+            double c = rhobar / r, s = beta / r;
+            double theta = s * alpha;
+            rhobar = -c * alpha;
+            double phi = c * phibar;
+            phibar = s * phibar;
+            normAr = phibar * alpha * std::abs(c);
+            // x += phi/rho w,  w = v - theta/rho w
+            const float a = phi / r, t = theta / r, scale = sv;
+            change = parallel_sweep<2>(mask.size(), [&](size_t j0, size_t j1, Eigen::Matrix<double,2,1>& acc) {
+              for (size_t j = j0; j < j1; j++) {
+                double dx2 = 0.0, x2 = 0.0;
+                for (size_t i = j*nc; i < (j+1)*nc; i++) {
+                  float dx = a * w[i];
+                  x[i] += dx;
+                  w[i] = scale * v[i] - t * w[i];
+                  dx2 += dx * dx;
+                  x2 += x[i] * x[i];
+                }
+                acc[0] += mask[j] * dx2;
+                acc[1] += mask[j] * x2;
+              }
+            });
+          }
+          else {
+            double rhoold = rho;
+            rho = std::hypot(alphabar, beta);
+            double c = alphabar / rho, s = beta / rho;
+            double thetanew = s * alpha;
+            alphabar = c * alpha;
+            double rhobarold = rhobar1;
+            double thetabar = sbar * rho;
+            rhobar1 = std::hypot(cbar * rho, thetanew);
+            cbar = cbar * rho / rhobar1;
+            sbar = thetanew / rhobar1;
+            double zeta = cbar * zetabar;
+            zetabar = -sbar * zetabar;
+            normAr = std::abs(zetabar);
+            // hbar = h - thetabar rho / (rhoold rhobarold) hbar,  x += zeta / (rho rhobar) hbar,
+            // h = v - thetanew / rho h  (h is stored in w)
+            const float a = zeta / (rho * rhobar1), t = thetabar * rho / (rhoold * rhobarold),
+                        th = thetanew / rho, scale = sv;
+            change = parallel_sweep<2>(mask.size(), [&](size_t j0, size_t j1, Eigen::Matrix<double,2,1>& acc) {
+              for (size_t j = j0; j < j1; j++) {
+                double dx2 = 0.0, x2 = 0.0;
+                for (size_t i = j*nc; i < (j+1)*nc; i++) {
+                  hbar[i] = w[i] - t * hbar[i];
+                  float dx = a * hbar[i];
+                  x[i] += dx;
+                  w[i] = scale * v[i] - th * w[i];
+                  dx2 += dx * dx;
+                  x2 += x[i] * x[i];
+                }
+                acc[0] += mask[j] * dx2;
+                acc[1] += mask[j] * x2;
+              }
+            });
+          }
+
+          err = normAr / normAr0;
+          double dxrel = (change[1] > 0.0) ? std::sqrt(change[0] / change[1]) : 0.0;
+          INFO((method == LSQR ? "LSQR" : "LSMR") + std::string(" iteration ") + str(iter) +
+               ": residual " + str(err) + ", step " + str(dxrel));
+          if (err < tol || dxrel < xtol)
+            break;
+        }
+        iter = std::min(iter, maxiter);
+        return x;
+      }
+
+    private:
+      const ReconMatrix& R;
+      const Method method;
+      const size_t nc;
+      float tol, xtol;
+      size_t maxiter, iter;
+      double err;
+      Eigen::VectorXf mask;
+      Eigen::VectorXf x, u, v, w, hbar, tmpm, tmpn;
+
+      /* u <- A v + f u, returning |sv| |u|, i.e., the norm of the unscaled update. The
+       * projection buffer is cleared in the same sweep, ready for the next call. */
+      double forward_step (const double f, const double sv)
+      {
+        R.project(tmpm, v);
+        const float ff = f;
+        double norm = std::sqrt(parallel_sweep<1>(u.size(), [&](size_t i0, size_t i1, Eigen::Matrix<double,1,1>& s) {
+          for (size_t i = i0; i < i1; i++) {
+            u[i] = tmpm[i] + ff * u[i];
+            tmpm[i] = 0.0f;
+            s[0] += double(u[i]) * u[i];
+          }
+        })[0]);
+        return std::abs(sv) * norm;
+      }
+
+      // v <- A^T u + g v, returning |su| |v|
+      double adjoint_step (const double g, const double su)
+      {
+        R.adjoint().project(tmpn, u);
+        const float gg = g;
+        double norm = std::sqrt(parallel_sweep<1>(v.size(), [&](size_t i0, size_t i1, Eigen::Matrix<double,1,1>& s) {
+          for (size_t i = i0; i < i1; i++) {
+            v[i] = tmpn[i] + gg * v[i];
+            tmpn[i] = 0.0f;
+            s[0] += double(v[i]) * v[i];
+          }
+        })[0]);
+        return std::abs(su) * norm;
+      }
+
+    };
+
+
+
+    /**
+     *  Deflated (preconditioned) conjugate gradient, with Krylov subspace recycling.
+     *
+     *  The solver is given a small subspace W of approximate eigenvectors of the normal matrix
+     *  A for its smallest eigenvalues, e.g. from a previous solve with a slightly different
+     *  operator. The initial guess is corrected by a Galerkin projection onto W, and all search
+     *  directions are kept A-orthogonal to W, which removes these slowly converging components
+     *  from the iterations. The cost is W.cols() extra products with A up front.
+     *
+     *  Up to depth search directions p and their products Ap are stored during the solve. Since
+     *  these are A-orthogonal to W and to each other, ritz() can extract an updated subspace by
+     *  Rayleigh-Ritz over [W, P] without any further products with A.
+     */
+    template <class MatrixType, class Preconditioner = Eigen::IdentityPreconditioner>
+    class DeflatedConjugateGradient
+    {  MEMALIGN(DeflatedConjugateGradient);
+    public:
+      DeflatedConjugateGradient (const MatrixType& A, const Eigen::MatrixXf& W, const size_t depth)
+        : A (A), W (W), depth (depth), tol (1e-4), maxiter (10), iter (0), err (0.0)
+      {
+        precond.compute(A);
+      }
+
+      void setTolerance (const float t)           { tol = t; }
+      void setMaxIterations (const size_t n)      { maxiter = n; }
+
+      size_t iterations () const { return iter; }
+      double error () const { return err; }
+
+      Eigen::VectorXf solveWithGuess (const Eigen::VectorXf& b, const Eigen::VectorXf& x0)
+      {
+        const size_t n = A.cols(), k = W.cols();
+        P.resize(n, 0); AP.resize(n, 0);
+        iter = 0; err = 0.0;
+        // deflation operators
+        AW.resize(n, k);
+        for (size_t i = 0; i < k; i++)
+          AW.col(i) = product(W.col(i));
+        E.compute((W.transpose() * AW).cast<double>());
+        if (k && E.info() != Eigen::Success)
+          throw Exception ("deflation subspace is degenerate.");
+
+        const double bnorm = b.norm();
+        if (bnorm == 0.0) return Eigen::VectorXf::Zero(n);
+        Eigen::VectorXf x = x0;
+        Eigen::VectorXf r = b - product(x);
+        // Galerkin correction on W
+        if (k) {
+          Eigen::VectorXf mu = E.solve((W.transpose() * r).cast<double>()).cast<float>();
+          x += W * mu;
+          r -= AW * mu;
+        }
+        Eigen::VectorXf z = precond.solve(r);
+        Eigen::VectorXf p = z - deflate(z);
+        double rz = r.dot(z);
+
+        for (iter = 0; iter < maxiter; ) {
+          err = r.norm() / bnorm;
+          if (err < tol) break;
+          Eigen::VectorXf Ap = product(p);
+          double pAp = p.dot(Ap);
+          if (pAp <= 0.0) break;
+          if (size_t(P.cols()) < depth) {
+            P.conservativeResize(n, P.cols()+1); P.rightCols<1>() = p;
+            AP.conservativeResize(n, AP.cols()+1); AP.rightCols<1>() = Ap;
+          }
+          float alpha = rz / pAp;
+          x += alpha * p;
+          r -= alpha * Ap;
+          z = precond.solve(r);
+          double rzold = rz;
+          rz = r.dot(z);
+          p = z + float(rz / rzold) * p;
+          p -= deflate(z);
+          iter++;
+        }
+        err = r.norm() / bnorm;
+        return x;
+      }
+
+      //! approximate eigenvectors of A for its m smallest eigenvalues, over span [W, P]
+      Eigen::MatrixXf ritz (const size_t m) const
+      {
+        const size_t k = W.cols(), s = k + P.cols();
+        if (s == 0) return W;
+        Eigen::MatrixXd G (s, s), F (s, s);
+        Eigen::MatrixXf Z (W.rows(), s), AZ (W.rows(), s);
+        Z << W, P;
+        AZ << AW, AP;
+        G = (Z.transpose() * AZ).cast<double>();
+        G = 0.5 * (G + G.transpose());
+        F = (Z.transpose() * Z).cast<double>();
+        // F y = (1/theta) G y; G is positive definite, and largest 1/theta are the smallest theta
+        Eigen::GeneralizedSelfAdjointEigenSolver<Eigen::MatrixXd> es (F, G);
+        if (es.info() != Eigen::Success) {
+          WARN("Ritz vector extraction failed; recycling previous subspace.");
+          return W;
+        }
+        size_t nr = std::min(m, s);
+        Eigen::MatrixXf R = Z * es.eigenvectors().rightCols(nr).rowwise().reverse().cast<float>();
+        R.colwise().normalize();
+        return R;
+      }
+
+    private:
+      const MatrixType& A;
+      const Eigen::MatrixXf W;
+      const size_t depth;
+      Preconditioner precond;
+      float tol;
+      size_t maxiter, iter;
+      double err;
+      Eigen::MatrixXf AW, P, AP;
+      Eigen::LDLT<Eigen::MatrixXd> E;
+
+      Eigen::VectorXf product (const Eigen::VectorXf& x) const {
+        Eigen::VectorXf y = A * x;
+        return y;
+      }
+
+      // W (W^T A W)^-1 (AW)^T z
+      Eigen::VectorXf deflate (const Eigen::VectorXf& z) const {
+        if (W.cols() == 0) return Eigen::VectorXf::Zero(z.size());
+        return W * E.solve((AW.transpose() * z).cast<double>()).cast<float>();
+      }
+    };
+
+
+
+    /**
+     *  Conjugate gradient on k normal systems (R^T W_k R + L^T L + Z^T Z) x_k = b_k at once,
+     *  e.g. for bootstrap replicates with their own voxel weights W_k. The k systems iterate in
+     *  lockstep with their own CG coefficients, so that every iteration takes a single pass of
+     *  the multi-image projection over the source data. Systems that have converged are frozen.
+     */
+    class BatchConjugateGradient
+    {  MEMALIGN(BatchConjugateGradient);
+    public:
+      using RowMatrixXf = ReconMatrix::RowMatrixXf;
+
+      BatchConjugateGradient (const ReconMatrix& R, const RowMatrixXf& Wvox)
+        : R (R), Wvox (Wvox), nc (R.mapping().xheader().size(3)),
+          tol (1e-4), maxiter (10), iter (0), err (0.0) { }
+
+      void setTolerance (const float t)           { tol = t; }
+      void setMaxIterations (const size_t n)      { maxiter = n; }
+
+      size_t iterations () const { return iter; }
+      //! largest relative residual over all systems
+      double error () const { return err; }
+
+      RowMatrixXf solveWithGuess (const RowMatrixXf& B, const RowMatrixXf& X0)
+      {
+        const size_t k = B.cols() / nc;
+        RowMatrixXf X = X0;
+        RowMatrixXf r = B;
+        RowMatrixXf Ap (B.rows(), B.cols()); Ap.setZero();
+        R.normal_multi_add(Ap, X, Wvox);
+        r -= Ap;
+        RowMatrixXf p = r;
+        Eigen::VectorXd bnorm = dots(B, B).cwiseSqrt();
+        Eigen::VectorXd rr = dots(r, r);
+        Eigen::VectorXf a (k), b (k);
+        for (iter = 0; iter < maxiter; ) {
+          Eigen::VectorXd res = rr.cwiseSqrt().cwiseQuotient(bnorm.cwiseMax(1e-30));
+          err = res.maxCoeff();
+          if (err < tol) break;
+          Ap.setZero();
+          R.normal_multi_add(Ap, p, Wvox);
+          Eigen::VectorXd pAp = dots(p, Ap);
+          for (size_t i = 0; i < k; i++)
+            a[i] = (res[i] < tol || pAp[i] <= 0.0) ? 0.0f : rr[i] / pAp[i];
+          X.noalias() += p * expand(a).asDiagonal();
+          r.noalias() -= Ap * expand(a).asDiagonal();
+          Eigen::VectorXd rrnew = dots(r, r);
+          for (size_t i = 0; i < k; i++)
+            b[i] = (a[i] == 0.0f) ? 0.0f : rrnew[i] / rr[i];
+          p = r + p * expand(b).asDiagonal();
+          rr = rrnew;
+          iter++;
+        }
+        err = rr.cwiseSqrt().cwiseQuotient(bnorm.cwiseMax(1e-30)).maxCoeff();
+        return X;
+      }
+
+    private:
+      const ReconMatrix& R;
+      const RowMatrixXf& Wvox;
+      const size_t nc;
+      float tol;
+      size_t maxiter, iter;
+      double err;
+
+      // inner products of the k images side by side
+      Eigen::VectorXd dots (const RowMatrixXf& A, const RowMatrixXf& B) const {
+        const Eigen::VectorXd acc = parallel_sweep<Eigen::Dynamic>(A.rows(), [&](size_t i0, size_t i1, Eigen::VectorXd& s) {
+          for (size_t i = i0; i < i1; i++)
+            s += A.row(i).cwiseProduct(B.row(i)).cast<double>().transpose();
+        }, A.cols());
+        Eigen::VectorXd d (A.cols() / nc);
+        for (Eigen::Index i = 0; i < d.size(); i++)
+          d[i] = acc.segment(i*nc, nc).sum();
+        return d;
+      }
+
+      // one coefficient per image, repeated over its ncoefs columns
+      Eigen::VectorXf expand (const Eigen::VectorXf& c) const {
+        Eigen::VectorXf e (c.size() * nc);
+        for (Eigen::Index i = 0; i < c.size(); i++)
+          e.segment(i*nc, nc).setConstant(c[i]);
+        return e;
+      }
+    };
+
+
+    }
+  }
+}
+
+
+#endif
+